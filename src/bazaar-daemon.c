@@ -21,13 +21,19 @@
 #include "config.h"
 
 #include <errno.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
 #include <sys/wait.h>
 #include <systemd/sd-bus.h>
+#include <systemd/sd-daemon.h>
 #include <systemd/sd-event.h>
 #include <unistd.h>
 
@@ -42,6 +48,16 @@
 #define UPDATE_CHECK_INTERVAL_USEC (60ULL * 60ULL * 1000000ULL) /* 1 hour */
 #define IDLE_EXIT_TIMEOUT_USEC     (5ULL * 1000000ULL)
 
+/* how many distinct queries are remembered, see lookup_cached_query () */
+#define QUERY_CACHE_SIZE 32
+
+/* name of the loaded index in systemd's fd store, see stash_index () */
+#define FDSTORE_INDEX_NAME "search-index"
+
+/* keeps one-letter queries from stalling the bus; can be overridden with
+ * BAZAAR_DAEMON_SCAN_BUDGET_USEC (0 disables the cap) */
+#define DEFAULT_SCAN_BUDGET_USEC (50ULL * 1000ULL)
+
 #define _cleanup_(x) __attribute__ ((cleanup (x)))
 
 #define SD_BUS_CHECK(expr) \
@@ -53,19 +69,58 @@
     }                      \
   while (0)
 
+typedef struct
+{
+  char            *key;
+  uint64_t         last_used;
+  size_t           n_matches;
+  SearchIndexMatch matches[MAX_SEARCH_RESULTS];
+} CachedQuery;
+
 static sd_event        *event               = NULL;
 static sd_bus          *bus                 = NULL;
 static pid_t            child_pid           = -1;
 static SearchIndex     *g_index             = NULL;
+static SearchIndex     *g_pending_index     = NULL;
 static char            *g_index_path        = NULL;
+static int              index_loaded_fd     = -1;
+static int              index_loading       = 0;
+static pthread_t        index_loader        = { 0 };
+static int              index_reload_queued = 0;
+static sd_event_source *index_watch_source  = NULL;
+static size_t           index_watch_len     = 0;
+static sd_event_source *index_loaded_source = NULL;
+static uint64_t         g_scan_budget_usec  = DEFAULT_SCAN_BUDGET_USEC;
+static char           **g_last_terms        = NULL;
+static SearchIndexHits  g_last_hits         = { 0 };
+static CachedQuery      query_cache[QUERY_CACHE_SIZE] = { 0 };
+static uint64_t         query_cache_clock   = 0;
 static sd_event_source *update_timer_source = NULL;
 static sd_event_source *idle_timer_source   = NULL;
 
 static void  log_msg (const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
 static void *malloc_or_bail (size_t n_bytes);
 static char *build_index_path (void);
-static void  ensure_index_loaded (void);
+static void  load_scan_budget (void);
+static void  init_index (void);
+static SearchIndex *adopt_stashed_index (void);
+static void  stash_index (void);
+static void  ensure_index_watch (void);
+static const char *index_watch_rest (size_t len);
+static int   on_index_dir_event (sd_event_source *s, const struct inotify_event *ev, void *userdata);
+static void  start_index_load (void);
+static void *load_index_thread (void *data);
+static int   on_index_loaded (sd_event_source *s, int fd, uint32_t revents, void *userdata);
+static void  search_index_unrefp (SearchIndex **idx);
+static void  forget_last_hits (void);
+static char *normalize_terms (char **terms);
+static int   cmp_strings (const void *a, const void *b);
+static const CachedQuery *lookup_cached_query (const char *key);
+static void  cache_query (const char *key, const SearchIndexMatch *matches, size_t n_matches);
+static void  clear_query_cache (void);
+static int   terms_refine (char **previous, char **terms);
 static int   strv_count_local (char **strv);
+static char **strv_dup_local (char **strv);
 static void  strv_free_local (char **strv);
 static void  strv_freep (char ***strv);
 static void  generic_freep (void *p);
@@ -79,7 +134,7 @@ static void  run_update_worker_once (void);
 static int   on_update_worker_exit (sd_event_source *s, const siginfo_t *si, void *userdata);
 static int   on_update_timer (sd_event_source *s, uint64_t usec, void *userdata);
 static int   schedule_next_update_check (void);
-static int   build_and_send_search_reply (sd_bus_message *call, char **terms);
+static int   build_and_send_search_reply (sd_bus_message *call, char **terms, int subsearch);
 static int   method_get_result_set (sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
 static int   method_get_result_metas (sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
 static int   method_activate_result (sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
@@ -168,7 +223,8 @@ main (int argc, char *argv[])
   if (r < 0)
     log_msg ("Failed to attach bus to event loop: %s", strerror (-r));
 
-  ensure_index_loaded ();
+  load_scan_budget ();
+  init_index ();
   schedule_next_update_check ();
 
   fwd_args = malloc_or_bail (sizeof (char *) * (size_t) (argc > 0 ? argc : 1));
@@ -196,7 +252,22 @@ main (int argc, char *argv[])
   if (update_timer_source != NULL)
     sd_event_source_unref (update_timer_source);
 
-  search_index_close (g_index);
+  /* the loader signals through the eventfd, which must stay open until
+   * it is done; its result is dropped */
+  if (index_loading)
+    pthread_join (index_loader, NULL);
+  search_index_unref (__atomic_exchange_n (&g_pending_index, NULL, __ATOMIC_ACQUIRE));
+
+  stash_index ();
+
+  if (index_watch_source != NULL)
+    sd_event_source_unref (index_watch_source);
+  if (index_loaded_source != NULL)
+    sd_event_source_unref (index_loaded_source);
+
+  forget_last_hits ();
+  clear_query_cache ();
+  search_index_unref (g_index);
   free (g_index_path);
 
   sd_bus_flush_close_unref (bus);
@@ -391,21 +462,462 @@ build_index_path (void)
 }
 
 static void
-ensure_index_loaded (void)
+load_scan_budget (void)
 {
-  if (g_index_path == NULL)
-    g_index_path = build_index_path ();
+  const char *value = NULL;
+  char       *end   = NULL;
+  uint64_t    usec  = 0;
+
+  value = getenv ("BAZAAR_DAEMON_SCAN_BUDGET_USEC");
+  if (value == NULL || *value == '\0')
+    return;
+
+  errno = 0;
+  usec  = strtoull (value, &end, 10);
+  if (errno != 0 || *end != '\0')
+    {
+      log_msg ("Ignoring invalid BAZAAR_DAEMON_SCAN_BUDGET_USEC \"%s\"", value);
+      return;
+    }
+
+  g_scan_budget_usec = usec;
+}
+
+/* Only this initial load happens on the main thread, before any request is
+ * served; afterwards the index is replaced from a background thread
+ * whenever the file changes */
+static void
+init_index (void)
+{
+  int r = 0;
+
+  g_index_path = build_index_path ();
+
+  g_index = adopt_stashed_index ();
+  if (g_index != NULL)
+    log_msg ("Adopted search index from the fd store");
+  else
+    g_index = search_index_open (g_index_path);
 
   if (g_index == NULL)
+    log_msg ("Search index not yet available at %s", g_index_path);
+
+  index_loaded_fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (index_loaded_fd < 0)
     {
-      g_index = search_index_open (g_index_path);
-      if (g_index == NULL)
-        log_msg ("Search index not yet available at %s", g_index_path);
+      log_msg ("Failed to create eventfd: %s", strerror (errno));
       return;
     }
 
-  if (search_index_reload_if_stale (&g_index))
-    log_msg ("Search index reloaded ");
+  r = sd_event_add_io (event, &index_loaded_source, index_loaded_fd,
+                       EPOLLIN, on_index_loaded, NULL);
+  if (r < 0)
+    {
+      log_msg ("Failed to watch for index loads: %s", strerror (-r));
+      close (index_loaded_fd);
+      index_loaded_fd = -1;
+      return;
+    }
+  sd_event_source_set_io_fd_own (index_loaded_source, 1);
+
+  ensure_index_watch ();
+}
+
+/* The previous instance may have left its index with systemd when it went
+ * idle; it is only used if the file it came from is still in place */
+static SearchIndex *
+adopt_stashed_index (void)
+{
+  _cleanup_ (strv_freep) char **names   = NULL;
+  SearchIndex                  *idx     = NULL;
+  int                           n_fds   = 0;
+  int                           stashed = 0;
+  int                           i       = 0;
+
+  n_fds = sd_listen_fds_with_names (1, &names);
+  for (i = 0; i < n_fds && names != NULL; i++)
+    {
+      int fd = SD_LISTEN_FDS_START + i;
+
+      if (strcmp (names[i], FDSTORE_INDEX_NAME) != 0)
+        continue;
+
+      if (idx == NULL)
+        idx = search_index_adopt (fd, g_index_path);
+      close (fd);
+      stashed = 1;
+    }
+
+  /* the mapping outlives the fd, so the store doesn't need to keep it */
+  if (stashed)
+    sd_notify (0, "FDSTOREREMOVE=1\nFDNAME=" FDSTORE_INDEX_NAME);
+
+  return idx;
+}
+
+static void
+stash_index (void)
+{
+  int fd = -1;
+  int r  = 0;
+
+  fd = search_index_export (g_index);
+  if (fd < 0)
+    return;
+
+  /* this is a no-op unless we run as a unit with a fd store */
+  r = sd_pid_notify_with_fds (0, 0, "FDSTORE=1\nFDNAME=" FDSTORE_INDEX_NAME, &fd, 1);
+  if (r < 0)
+    log_msg ("Failed to hand the search index to systemd: %s", strerror (-r));
+  else if (r > 0)
+    log_msg ("Search index handed to systemd");
+
+  close (fd);
+}
+
+/* Watches the directory of the index file or, as long as that does not
+ * exist yet, the closest parent that does, so a fresh install picks the
+ * index up once the app writes it */
+static void
+ensure_index_watch (void)
+{
+  char  *dir = NULL;
+  size_t len = 0;
+  int    r   = 0;
+
+  if (index_watch_source != NULL || index_loaded_fd < 0)
+    return;
+
+  dir = strdup (g_index_path);
+  if (dir == NULL)
+    return;
+
+  len = strlen (dir);
+  for (;;)
+    {
+      uint32_t mask = 0;
+
+      while (len > 0 && dir[len - 1] != '/')
+        len--;
+      if (len == 0)
+        break;
+      if (len > 1)
+        len--;
+      dir[len] = '\0';
+
+      /* the writer renames a finished file into place, and the directories
+       * above it show up one at a time */
+      if (strchr (index_watch_rest (len), '/') == NULL)
+        mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR;
+      else
+        mask = IN_CREATE | IN_MOVED_TO | IN_ONLYDIR;
+
+      r = sd_event_add_inotify (event, &index_watch_source, dir, mask,
+                                on_index_dir_event, NULL);
+      if (r >= 0)
+        {
+          index_watch_len = len;
+          break;
+        }
+      if ((r != -ENOENT && r != -ENOTDIR) || len == 1)
+        break;
+    }
+
+  if (r < 0)
+    log_msg ("Not watching %s yet: %s", dir, strerror (-r));
+  else if (index_watch_source != NULL &&
+           strchr (index_watch_rest (len), '/') != NULL)
+    log_msg ("Watching %s until the search index directory exists", dir);
+
+  free (dir);
+}
+
+/* The part of the index path below a watched directory of length `len` */
+static const char *
+index_watch_rest (size_t len)
+{
+  return g_index_path + len + (len > 1 ? 1 : 0);
+}
+
+static int
+on_index_dir_event (sd_event_source            *s,
+                    const struct inotify_event *ev,
+                    void                       *userdata)
+{
+  const char *rest  = NULL;
+  const char *slash = NULL;
+
+  if (ev->mask & IN_IGNORED)
+    {
+      /* the directory went away, so wait for it to come back */
+      sd_event_source_unref (index_watch_source);
+      index_watch_source = NULL;
+      ensure_index_watch ();
+      return 0;
+    }
+
+  rest  = index_watch_rest (index_watch_len);
+  slash = strchr (rest, '/');
+  if (slash != NULL)
+    {
+      /* only a parent is watched, so move down once the next directory on
+       * the way shows up */
+      if (!(ev->mask & IN_Q_OVERFLOW) &&
+          (ev->len == 0 ||
+           strncmp (ev->name, rest, (size_t) (slash - rest)) != 0 ||
+           ev->name[slash - rest] != '\0'))
+        return 0;
+
+      sd_event_source_unref (index_watch_source);
+      index_watch_source = NULL;
+      ensure_index_watch ();
+
+      /* the file may have been written before the watch got there */
+      if (index_watch_source != NULL &&
+          strchr (index_watch_rest (index_watch_len), '/') == NULL)
+        start_index_load ();
+      return 0;
+    }
+
+  if (!(ev->mask & IN_Q_OVERFLOW))
+    {
+      if (ev->len == 0 || strcmp (ev->name, rest) != 0)
+        return 0;
+    }
+
+  start_index_load ();
+  return 0;
+}
+
+static void
+start_index_load (void)
+{
+  char *path = NULL;
+  int   r    = 0;
+
+  if (index_loaded_fd < 0)
+    return;
+
+  if (index_loading)
+    {
+      /* several writes in a row are folded into one more load */
+      index_reload_queued = 1;
+      return;
+    }
+
+  path = strdup (g_index_path);
+  if (path == NULL)
+    return;
+
+  /* joined in on_index_loaded (), or on the way out */
+  r = pthread_create (&index_loader, NULL, load_index_thread, path);
+  if (r != 0)
+    {
+      log_msg ("Failed to start index loader: %s", strerror (r));
+      free (path);
+      return;
+    }
+
+  index_loading = 1;
+}
+
+static void *
+load_index_thread (void *data)
+{
+  char        *path  = data;
+  SearchIndex *fresh = NULL;
+  uint64_t     one   = 1;
+
+  fresh = search_index_open (path);
+  free (path);
+
+  __atomic_store_n (&g_pending_index, fresh, __ATOMIC_RELEASE);
+  if (write (index_loaded_fd, &one, sizeof (one)) < 0)
+    perror ("write");
+
+  return NULL;
+}
+
+static int
+on_index_loaded (sd_event_source *s,
+                 int              fd,
+                 uint32_t         revents,
+                 void            *userdata)
+{
+  uint64_t     count = 0;
+  SearchIndex *fresh = NULL;
+
+  if (read (fd, &count, sizeof (count)) < 0)
+    return 0;
+
+  /* the loader is done once it has signalled */
+  if (index_loading)
+    pthread_join (index_loader, NULL);
+
+  fresh         = __atomic_exchange_n (&g_pending_index, NULL, __ATOMIC_ACQUIRE);
+  index_loading = 0;
+
+  if (fresh != NULL)
+    {
+      /* requests are handled on this thread too, so none can be halfway
+       * through the old index here; any that still hold a reference keep
+       * the old mapping alive until they drop it */
+      forget_last_hits ();
+      clear_query_cache ();
+      search_index_unref (g_index);
+      g_index = fresh;
+      log_msg ("Search index reloaded");
+    }
+  else
+    log_msg ("Failed to load search index from %s", g_index_path);
+
+  if (index_reload_queued)
+    {
+      index_reload_queued = 0;
+      start_index_load ();
+    }
+
+  return 0;
+}
+
+static void
+search_index_unrefp (SearchIndex **idx)
+{
+  search_index_unref (*idx);
+}
+
+static void
+forget_last_hits (void)
+{
+  strv_free_local (g_last_terms);
+  g_last_terms = NULL;
+  search_index_hits_clear (&g_last_hits);
+}
+
+/* Scoring ignores case and the order of terms, so neither should the key */
+static char *
+normalize_terms (char **terms)
+{
+  _cleanup_ (generic_freep) char **sorted = NULL;
+  char                            *key    = NULL;
+  char                            *p      = NULL;
+  size_t                           len    = 1;
+  int                              n      = 0;
+  int                              i      = 0;
+
+  n      = strv_count_local (terms);
+  sorted = malloc_or_bail (sizeof (char *) * (size_t) (n > 0 ? n : 1));
+  for (i = 0; i < n; i++)
+    {
+      sorted[i] = terms[i];
+      len += strlen (terms[i]) + 1;
+    }
+  qsort (sorted, (size_t) n, sizeof (char *), cmp_strings);
+
+  key = malloc_or_bail (len);
+  p   = key;
+  for (i = 0; i < n; i++)
+    {
+      const char *c = NULL;
+
+      if (i > 0)
+        *p++ = '\x1f';
+      for (c = sorted[i]; *c != '\0'; c++)
+        *p++ = (*c >= 'A' && *c <= 'Z') ? *c + ('a' - 'A') : *c;
+    }
+  *p = '\0';
+
+  return key;
+}
+
+static int
+cmp_strings (const void *a,
+             const void *b)
+{
+  return strcasecmp (*(char *const *) a, *(char *const *) b);
+}
+
+static const CachedQuery *
+lookup_cached_query (const char *key)
+{
+  int i = 0;
+
+  for (i = 0; i < QUERY_CACHE_SIZE; i++)
+    {
+      if (query_cache[i].key != NULL &&
+          strcmp (query_cache[i].key, key) == 0)
+        {
+          query_cache[i].last_used = ++query_cache_clock;
+          return &query_cache[i];
+        }
+    }
+
+  return NULL;
+}
+
+static void
+cache_query (const char             *key,
+             const SearchIndexMatch *matches,
+             size_t                  n_matches)
+{
+  CachedQuery *slot = NULL;
+  int          i    = 0;
+
+  /* take an empty slot, or else the least recently used one */
+  slot = &query_cache[0];
+  for (i = 0; i < QUERY_CACHE_SIZE && slot->key != NULL; i++)
+    {
+      if (query_cache[i].key == NULL ||
+          query_cache[i].last_used < slot->last_used)
+        slot = &query_cache[i];
+    }
+
+  free (slot->key);
+  slot->key = strdup (key);
+  if (slot->key == NULL)
+    return;
+
+  slot->last_used = ++query_cache_clock;
+  slot->n_matches = n_matches;
+  memcpy (slot->matches, matches, sizeof (SearchIndexMatch) * n_matches);
+}
+
+static void
+clear_query_cache (void)
+{
+  int i = 0;
+
+  for (i = 0; i < QUERY_CACHE_SIZE; i++)
+    {
+      free (query_cache[i].key);
+      query_cache[i].key = NULL;
+    }
+}
+
+/* Whether every match for `terms` is guaranteed to also match `previous`,
+ * which holds when each previous term is part of some new term */
+static int
+terms_refine (char **previous,
+              char **terms)
+{
+  char **p = NULL;
+  char **t = NULL;
+
+  if (previous == NULL || terms == NULL)
+    return 0;
+
+  for (p = previous; *p != NULL; p++)
+    {
+      int covered = 0;
+
+      for (t = terms; *t != NULL && !covered; t++)
+        covered = strcasestr (*t, *p) != NULL;
+
+      if (!covered)
+        return 0;
+    }
+
+  return 1;
 }
 
 static int
@@ -422,6 +934,29 @@ strv_count_local (char **strv)
   return n;
 }
 
+static char **
+strv_dup_local (char **strv)
+{
+  char **copy = NULL;
+  int    n    = 0;
+  int    i    = 0;
+
+  n    = strv_count_local (strv);
+  copy = malloc_or_bail (sizeof (char *) * (size_t) (n + 1));
+  for (i = 0; i < n; i++)
+    {
+      copy[i] = strdup (strv[i]);
+      if (copy[i] == NULL)
+        {
+          perror ("strdup");
+          _exit (127);
+        }
+    }
+  copy[n] = NULL;
+
+  return copy;
+}
+
 static void
 strv_free_local (char **strv)
 {
@@ -456,7 +991,11 @@ on_child_exit (sd_event_source *s,
 
   child_pid = -1;
   sd_event_source_unref (s);
-  ensure_index_loaded ();
+
+  /* in case the watch could not be set up at all */
+  ensure_index_watch ();
+  if (g_index == NULL)
+    start_index_load ();
 
   arm_idle_timer ();
 
@@ -583,26 +1122,64 @@ schedule_next_update_check (void)
 
 static int
 build_and_send_search_reply (sd_bus_message *call,
-                             char          **terms)
+                             char          **terms,
+                             int             subsearch)
 {
   _cleanup_ (sd_bus_message_unrefp) sd_bus_message *reply                       = NULL;
+  _cleanup_ (search_index_unrefp) SearchIndex      *idx                         = NULL;
+  _cleanup_ (generic_freep) char                   *key                         = NULL;
+  const CachedQuery                                *cached                      = NULL;
   SearchIndexMatch                                  matches[MAX_SEARCH_RESULTS] = { 0 };
+  SearchIndexHits                                   hits                        = { 0 };
+  const SearchIndexHits                            *within                      = NULL;
   size_t                                            n_matches                   = 0;
   size_t                                            i                           = 0;
   int                                               r                           = 0;
 
-  ensure_index_loaded ();
+  idx = search_index_ref (g_index);
+  key = normalize_terms (terms);
 
-  n_matches = search_index_query (
-      g_index, (const char *const *) terms,
-      strv_count_local (terms),
-      matches, MAX_SEARCH_RESULTS);
+  cached = lookup_cached_query (key);
+  if (cached != NULL)
+    {
+      n_matches = cached->n_matches;
+      memcpy (matches, cached->matches, sizeof (SearchIndexMatch) * n_matches);
+    }
+  else
+    {
+      /* typing one more character can only shrink the match set, so only
+       * the previous matches need to be looked at again */
+      if (subsearch &&
+          g_last_hits.complete &&
+          terms_refine (g_last_terms, terms))
+        within = &g_last_hits;
+
+      n_matches = search_index_query (
+          idx, (const char *const *) terms,
+          strv_count_local (terms),
+          within, g_scan_budget_usec,
+          matches, MAX_SEARCH_RESULTS,
+          &hits);
+
+      /* a scan cut short by the budget may rank differently next time */
+      if (hits.complete)
+        cache_query (key, matches, n_matches);
+
+      forget_last_hits ();
+      g_last_terms = strv_dup_local (terms);
+      g_last_hits  = hits;
+    }
 
   SD_BUS_CHECK (sd_bus_message_new_method_return (call, &reply));
   SD_BUS_CHECK (sd_bus_message_open_container (reply, 'a', "s"));
 
   for (i = 0; i < n_matches; i++)
-    SD_BUS_CHECK (sd_bus_message_append (reply, "s", matches[i].entry->id));
+    {
+      SearchIndexEntry e = { 0 };
+
+      search_index_get_entry (idx, matches[i].index, &e);
+      SD_BUS_CHECK (sd_bus_message_append (reply, "s", e.id));
+    }
 
   SD_BUS_CHECK (sd_bus_message_close_container (reply));
 
@@ -617,9 +1194,10 @@ method_get_result_set (sd_bus_message *m,
                        void           *userdata,
                        sd_bus_error   *ret_error)
 {
-  _cleanup_ (strv_freep) char **terms = NULL;
-  const char                   *sig   = NULL;
-  int                           r     = 0;
+  _cleanup_ (strv_freep) char **terms     = NULL;
+  const char                   *sig       = NULL;
+  int                           subsearch = 0;
+  int                           r         = 0;
 
   arm_idle_timer ();
 
@@ -629,16 +1207,20 @@ method_get_result_set (sd_bus_message *m,
     {
       _cleanup_ (strv_freep) char **previous = NULL;
 
+      /* only the top results are listed here; the full match set of the
+       * last query is kept by the daemon itself */
       r = sd_bus_message_read_strv (m, &previous);
       if (r < 0)
         return r;
+
+      subsearch = 1;
     }
 
   r = sd_bus_message_read_strv (m, &terms);
   if (r < 0)
     return r;
 
-  return build_and_send_search_reply (m, terms);
+  return build_and_send_search_reply (m, terms, subsearch);
 }
 
 static int
@@ -647,6 +1229,7 @@ method_get_result_metas (sd_bus_message *m,
                          sd_bus_error   *ret_error)
 {
   _cleanup_ (sd_bus_message_unrefp) sd_bus_message *reply = NULL;
+  _cleanup_ (search_index_unrefp) SearchIndex      *idx   = NULL;
   _cleanup_ (strv_freep) char                     **ids   = NULL;
   char                                            **p     = NULL;
   int                                               r     = 0;
@@ -657,29 +1240,27 @@ method_get_result_metas (sd_bus_message *m,
   if (r < 0)
     return r;
 
-  ensure_index_loaded ();
+  idx = search_index_ref (g_index);
 
   SD_BUS_CHECK (sd_bus_message_new_method_return (m, &reply));
   SD_BUS_CHECK (sd_bus_message_open_container (reply, 'a', "a{sv}"));
 
   for (p = ids; p != NULL && *p != NULL; p++)
     {
-      const SearchIndexEntry *e = NULL;
-
-      e = search_index_find (g_index, *p);
+      SearchIndexEntry e = { 0 };
 
-      if (e == NULL)
+      if (!search_index_find (idx, *p, &e))
         continue;
 
       SD_BUS_CHECK (sd_bus_message_open_container (reply, 'a', "{sv}"));
-      SD_BUS_CHECK (sd_bus_message_append (reply, "{sv}", "id", "s", e->id));
-      SD_BUS_CHECK (sd_bus_message_append (reply, "{sv}", "name", "s", e->title));
+      SD_BUS_CHECK (sd_bus_message_append (reply, "{sv}", "id", "s", e.id));
+      SD_BUS_CHECK (sd_bus_message_append (reply, "{sv}", "name", "s", e.title));
 
-      if (e->description != NULL)
-        SD_BUS_CHECK (sd_bus_message_append (reply, "{sv}", "description", "s", e->description));
+      if (e.description != NULL)
+        SD_BUS_CHECK (sd_bus_message_append (reply, "{sv}", "description", "s", e.description));
 
-      if (e->icon_path != NULL)
-        SD_BUS_CHECK (sd_bus_message_append (reply, "{sv}", "gicon", "s", e->icon_path));
+      if (e.icon_path != NULL)
+        SD_BUS_CHECK (sd_bus_message_append (reply, "{sv}", "gicon", "s", e.icon_path));
 
       SD_BUS_CHECK (sd_bus_message_close_container (reply));
     }
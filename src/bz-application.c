@@ -3582,6 +3582,9 @@ init_service_struct (BzApplication *self,
   self->search_engine = bz_search_engine_new ();
   bz_search_engine_set_model (self->search_engine, G_LIST_MODEL (self->group_filter_model));
   bz_search_engine_set_biases (self->search_engine, G_LIST_MODEL (self->search_biases));
+  g_settings_bind (self->settings, "search-typo-tolerance",
+                   self->search_engine, "fuzzy",
+                   G_SETTINGS_BIND_GET);
 
   self->curated_provider = bz_content_provider_new ();
   bz_content_provider_set_input_files (
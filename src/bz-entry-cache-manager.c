@@ -24,7 +24,36 @@
 #define MAX_CONCURRENT_WRITES       16
 #define WATCH_CLEANUP_INTERVAL_MSEC 5000
 
+/* Entries are appended to a few large segment files, `store.00000001` and
+ * on, and `store.index` maps each unique ID checksum to its latest record
+ * there. Processes take turns through a flock on `store.lock`, shared for
+ * reading and exclusive for writing. */
+#define STORE_LOCK_NAME      "store.lock"
+#define STORE_INDEX_NAME     "store.index"
+#define STORE_SEGMENT_PREFIX "store."
+#define STORE_INDEX_MAGIC    "BZENTIX1"
+#define STORE_RECORD_MAGIC   0x52455a42
+#define STORE_KEY_SIZE       32
+#define STORE_MIN_SLOTS      4096
+
+/* a new segment is started once the current one would grow past this */
+#define STORE_SEGMENT_SIZE (64 * 1024 * 1024)
+
+/* compacting writes the surviving records out in chunks of this size */
+#define STORE_WRITE_CHUNK (4 * 1024 * 1024)
+
+/* Superseded records are only dropped once there are at least this many
+ * bytes of them and they outweigh the live ones */
+#define STORE_COMPACT_MIN (16 * 1024 * 1024)
+
+#include <errno.h>
+#include <fcntl.h>
 #include <malloc.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <glib/gstdio.h>
 
 #include "bz-entry-cache-manager.h"
 #include "bz-flatpak-entry.h"
@@ -37,6 +66,20 @@
 G_DEFINE_QUARK (bz-entry-cache-error-quark, bz_entry_cache_error);
 /* clang-format on */
 
+/* The lock and index descriptors, kept open for as long as the manager
+ * lives. Threads of this process take turns through `rwlock`, and the
+ * flock is held while any of them is inside; `index_fd` is reopened
+ * whenever the index was replaced in between. */
+typedef struct
+{
+  char   *dir;
+  int     lock_fd;
+  int     index_fd;
+  GRWLock rwlock;
+  GMutex  mutex;
+  guint   n_shared;
+} StoreFiles;
+
 struct _BzEntryCacheManager
 {
   GObject parent_instance;
@@ -66,6 +109,8 @@ struct _BzEntryCacheManager
   GMutex   writing_mutex;
 
   DexFuture *watch_task;
+
+  StoreFiles store_files;
 };
 
 G_DEFINE_FINAL_TYPE (BzEntryCacheManager, bz_entry_cache_manager, G_TYPE_OBJECT);
@@ -136,6 +181,168 @@ read_task_fiber (ReadTaskData *data);
 static DexFuture *
 enumerate_disk_fiber (GWeakRef *wr);
 
+/* Everything on disk is in host byte order, since the cache never leaves
+ * the machine. `store.index` is this header followed by `n_slots` slots,
+ * a power of two, and is kept at most half full. */
+typedef struct
+{
+  char    magic[8];
+  guint32 n_slots;
+  guint32 n_used;
+  guint32 segment;
+  guint32 first_segment;
+  guint64 live_bytes;
+  guint64 dead_bytes;
+} StoreHeader;
+
+/* An unused slot has an empty key */
+typedef struct
+{
+  char    key[STORE_KEY_SIZE];
+  guint32 segment;
+  guint32 length;
+  guint64 offset;
+} StoreSlot;
+
+/* Precedes the serialized entry in a segment */
+typedef struct
+{
+  guint32 magic;
+  guint32 length;
+  char    key[STORE_KEY_SIZE];
+} StoreRecord;
+
+/* The store while it is locked; only valid between store_open () and
+ * store_close () */
+typedef struct
+{
+  StoreFiles *files;
+  gboolean    exclusive;
+  gboolean    locked;
+  StoreHeader header;
+} Store;
+
+static void
+store_files_init (StoreFiles *files);
+
+static void
+store_files_clear (StoreFiles *files);
+
+static gboolean
+store_files_lock (StoreFiles *files,
+                  gboolean    exclusive,
+                  GError    **error);
+
+static gboolean
+store_open (Store      *store,
+            StoreFiles *files,
+            gboolean    exclusive,
+            GError    **error);
+
+static void
+store_close (Store *store);
+
+G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC (Store, store_close);
+
+static gboolean
+store_find (Store      *store,
+            const char *key,
+            StoreSlot  *slot_out,
+            guint32    *position_out,
+            gboolean   *found_out,
+            GError    **error);
+
+static GBytes *
+store_load (Store           *store,
+            const StoreSlot *slot,
+            GError         **error);
+
+static GBytes *
+store_read_record (int              fd,
+                   const char      *path,
+                   const StoreSlot *slot,
+                   GError         **error);
+
+static gboolean
+store_put (Store      *store,
+           const char *key,
+           GBytes     *bytes,
+           GError    **error);
+
+static gboolean
+store_collect_keys (Store      *store,
+                    GHashTable *set,
+                    GError    **error);
+
+static gboolean
+store_reset (Store   *store,
+             GError **error);
+
+static gboolean
+store_rebuild (Store   *store,
+               guint32  n_slots,
+               gboolean compact,
+               GError **error);
+
+static gboolean
+store_write_index (Store             *store,
+                   const StoreHeader *header,
+                   const StoreSlot   *slots,
+                   GError           **error);
+
+static void
+store_remove_segments (Store  *store,
+                       guint32 keep_first,
+                       guint32 keep_last);
+
+static char *
+store_segment_path (Store  *store,
+                    guint32 segment);
+
+static gboolean
+store_key_is_valid (const char *key);
+
+static guint32
+store_hash (const char *key);
+
+static gint
+cmp_slots (gconstpointer a,
+           gconstpointer b);
+
+static gboolean
+read_at (int      fd,
+         gpointer buf,
+         gsize    size,
+         goffset  offset,
+         GError **error);
+
+static gboolean
+write_at (int           fd,
+          gconstpointer buf,
+          gsize         size,
+          goffset       offset,
+          GError      **error);
+
+static gboolean
+write_all (int           fd,
+           gconstpointer buf,
+           gsize         size,
+           GError      **error);
+
+static gboolean
+set_errno_error (GError    **error,
+                 int         saved_errno,
+                 const char *what,
+                 const char *path);
+
+static GBytes *
+load_entry_bytes (StoreFiles *files,
+                  const char *unique_id_checksum,
+                  GError    **error);
+
+static void
+migrate_loose_entries (StoreFiles *files);
+
 static void
 bz_entry_cache_manager_dispose (GObject *object)
 {
@@ -161,6 +368,7 @@ bz_entry_cache_manager_dispose (GObject *object)
   g_mutex_clear (&self->alive_mutex);
   g_mutex_clear (&self->reading_mutex);
   g_mutex_clear (&self->writing_mutex);
+  store_files_clear (&self->store_files);
 
   G_OBJECT_CLASS (bz_entry_cache_manager_parent_class)->dispose (object);
 }
@@ -240,6 +448,7 @@ bz_entry_cache_manager_init (BzEntryCacheManager *self)
   g_mutex_init (&self->alive_mutex);
   g_mutex_init (&self->reading_mutex);
   g_mutex_init (&self->writing_mutex);
+  store_files_init (&self->store_files);
 
   self->watch_task = dex_scheduler_spawn (
       self->scheduler,
@@ -369,16 +578,7 @@ write_task_fiber (WriteTaskData *data)
   g_autoptr (GVariantBuilder) builder     = NULL;
   g_autoptr (GVariant) variant            = NULL;
   g_autoptr (GBytes) bytes                = NULL;
-  gsize            bytes_size             = 0;
-  gconstpointer    bytes_data             = 0;
-  g_autofree char *main_cache             = NULL;
-  g_autoptr (GFile) parent_file           = NULL;
-  g_autofree char *save_file_path         = NULL;
-  g_autoptr (GFile) save_file             = NULL;
-  gsize            existing_contents_size = 0;
-  g_autofree char *existing_contents      = NULL;
-  g_autoptr (GFileOutputStream) output    = NULL;
-  gssize   bytes_written                  = 0;
+  g_auto (Store) store                    = { 0 };
   gboolean result                         = FALSE;
   g_autoptr (GError) ret_error            = NULL;
 
@@ -465,76 +665,21 @@ write_task_fiber (WriteTaskData *data)
   {
     builder = g_variant_builder_new (G_VARIANT_TYPE_VARDICT);
     bz_serializable_serialize (BZ_SERIALIZABLE (entry), builder);
-    variant    = g_variant_builder_end (builder);
-    bytes      = g_variant_get_data_as_bytes (variant);
-    bytes_data = g_bytes_get_data (bytes, &bytes_size);
+    variant = g_variant_builder_end (builder);
+    bytes   = g_variant_get_data_as_bytes (variant);
 
-    main_cache  = bz_dup_module_dir ();
-    parent_file = g_file_new_for_path (main_cache);
-    result      = g_file_make_directory_with_parents (parent_file, NULL, &local_error);
+    result = store_open (&store, &self->store_files, TRUE, &local_error);
+    if (result)
+      result = store_put (&store, unique_id_checksum, bytes, &local_error);
+    store_close (&store);
     if (!result)
       {
-        if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_EXISTS))
-          g_clear_pointer (&local_error, g_error_free);
-        else
-          {
-            ret_error = g_error_new (
-                BZ_ENTRY_CACHE_ERROR,
-                BZ_ENTRY_CACHE_ERROR_CACHE_FAILED,
-                "Failed to make parent directory '%s' when caching '%s': %s",
-                main_cache, unique_id_checksum, local_error->message);
-            goto done;
-          }
-      }
-    save_file_path = g_build_filename (main_cache, unique_id_checksum, NULL);
-    save_file      = g_file_new_for_path (save_file_path);
-
-    result = g_file_get_contents (
-        save_file_path, &existing_contents,
-        &existing_contents_size, NULL);
-    /* Only write if the file has definitely changed */
-    if (!result ||
-        existing_contents_size != bytes_size ||
-        memcmp (existing_contents, bytes_data, bytes_size) != 0)
-      {
-        output = g_file_replace (
-            save_file,
-            NULL,
-            FALSE,
-            G_FILE_CREATE_REPLACE_DESTINATION,
-            NULL,
-            &local_error);
-        if (output == NULL)
-          {
-            ret_error = g_error_new (
-                BZ_ENTRY_CACHE_ERROR,
-                BZ_ENTRY_CACHE_ERROR_CACHE_FAILED,
-                "Failed to open write stream when caching '%s': %s",
-                unique_id_checksum, local_error->message);
-            goto done;
-          }
-
-        bytes_written = g_output_stream_write_bytes (G_OUTPUT_STREAM (output), bytes, NULL, &local_error);
-        if (bytes_written < 0)
-          {
-            ret_error = g_error_new (
-                BZ_ENTRY_CACHE_ERROR,
-                BZ_ENTRY_CACHE_ERROR_CACHE_FAILED,
-                "Failed to write data to stream when caching '%s': %s",
-                unique_id_checksum, local_error->message);
-            goto done;
-          }
-
-        result = g_output_stream_close (G_OUTPUT_STREAM (output), NULL, &local_error);
-        if (!result)
-          {
-            ret_error = g_error_new (
-                BZ_ENTRY_CACHE_ERROR,
-                BZ_ENTRY_CACHE_ERROR_CACHE_FAILED,
-                "Failed to close stream when caching '%s': %s",
-                unique_id_checksum, local_error->message);
-            goto done;
-          }
+        ret_error = g_error_new (
+            BZ_ENTRY_CACHE_ERROR,
+            BZ_ENTRY_CACHE_ERROR_CACHE_FAILED,
+            "Failed to store '%s': %s",
+            unique_id_checksum, local_error->message);
+        goto done;
       }
 
     g_timer_start (living->cached);
@@ -573,9 +718,6 @@ read_task_fiber (ReadTaskData *data)
   g_autoptr (LivingEntryData) living   = NULL;
   DexFuture *reading_future            = NULL;
   g_autoptr (DexPromise) promise       = NULL;
-  g_autofree char *main_cache          = NULL;
-  g_autofree char *path                = NULL;
-  g_autoptr (GFile) file               = NULL;
   g_autoptr (GBytes) bytes             = NULL;
   g_autoptr (GVariant) variant         = NULL;
   g_autoptr (BzFlatpakEntry) entry     = NULL;
@@ -661,18 +803,14 @@ read_task_fiber (ReadTaskData *data)
 
   /* living data was guarded */
 
-  main_cache = bz_dup_module_dir ();
-  path       = g_build_filename (main_cache, unique_id_checksum, NULL);
-  file       = g_file_new_for_path (path);
-
-  bytes = g_file_load_bytes (file, NULL, NULL, &local_error);
+  bytes = load_entry_bytes (&self->store_files, unique_id_checksum, &local_error);
   if (bytes == NULL)
     {
       ret_error = g_error_new (
           BZ_ENTRY_CACHE_ERROR,
           BZ_ENTRY_CACHE_ERROR_DECACHE_FAILED,
-          "Failed to de-cache variant from file: %s",
-          local_error->message);
+          "Failed to de-cache variant for '%s': %s",
+          unique_id_checksum, local_error->message);
       goto done;
     }
 
@@ -682,8 +820,8 @@ read_task_fiber (ReadTaskData *data)
       ret_error = g_error_new (
           BZ_ENTRY_CACHE_ERROR,
           BZ_ENTRY_CACHE_ERROR_DECACHE_FAILED,
-          "Failed to interpret variant from %s: %s",
-          path, local_error->message);
+          "Failed to interpret variant for '%s': %s",
+          unique_id_checksum, local_error->message);
       goto done;
     }
 
@@ -694,8 +832,8 @@ read_task_fiber (ReadTaskData *data)
       ret_error = g_error_new (
           BZ_ENTRY_CACHE_ERROR,
           BZ_ENTRY_CACHE_ERROR_DECACHE_FAILED,
-          "Failed to deserialize entry from %s: %s",
-          path, local_error->message);
+          "Failed to deserialize entry '%s': %s",
+          unique_id_checksum, local_error->message);
       goto done;
     }
   g_weak_ref_init (&living->wr, entry);
@@ -728,11 +866,14 @@ enumerate_disk_fiber (GWeakRef *wr)
   g_autoptr (BzGuard) guard              = NULL;
   g_autoptr (GHashTable) set             = NULL;
   g_autofree char *main_cache            = NULL;
+  g_auto (Store) store                   = { 0 };
   g_autoptr (GFile) main_cache_file      = NULL;
   g_autoptr (GFileEnumerator) enumerator = NULL;
 
   bz_weak_get_or_return_reject (self, wr);
 
+  dex_await (dex_ref (self->init), NULL);
+
   set = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 
   BZ_BEGIN_GUARD_WITH_CONTEXT (&guard, &self->alive_mutex, &self->alive_gate);
@@ -743,6 +884,16 @@ enumerate_disk_fiber (GWeakRef *wr)
   if (!g_file_test (main_cache, G_FILE_TEST_EXISTS))
     goto done;
 
+  if (!store_open (&store, &self->store_files, FALSE, &local_error) ||
+      !store_collect_keys (&store, set, &local_error))
+    return dex_future_new_reject (
+        BZ_ENTRY_CACHE_ERROR,
+        BZ_ENTRY_CACHE_ERROR_ENUMERATE_FAILED,
+        "Could not read the entry store at %s: %s",
+        main_cache, local_error->message);
+  store_close (&store);
+
+  /* and whatever could not be moved into it */
   main_cache_file = g_file_new_for_path (main_cache);
   enumerator      = g_file_enumerate_children (
       main_cache_file,
@@ -784,7 +935,8 @@ enumerate_disk_fiber (GWeakRef *wr)
         continue;
 
       basename = g_file_get_basename (child);
-      if (basename != NULL)
+      if (basename != NULL &&
+          store_key_is_valid (basename))
         g_hash_table_replace (set, g_steal_pointer (&basename), NULL);
     }
 
@@ -800,6 +952,7 @@ watch_init_fiber (GWeakRef *wr)
   bz_weak_get_or_return_reject (self, wr);
 
   // bz_discard_module_dir ();
+  migrate_loose_entries (&self->store_files);
   dex_promise_resolve_boolean (self->init, TRUE);
 
   return dex_future_finally_loop (
@@ -914,4 +1067,965 @@ notify_props_fiber (GWeakRef *wr)
   return dex_future_new_true ();
 }
 
+/* Looks in the store first and falls back to a file of the old layout, in
+ * case that could not be moved over */
+static GBytes *
+load_entry_bytes (StoreFiles *files,
+                  const char *unique_id_checksum,
+                  GError    **error)
+{
+  g_auto (Store) store        = { 0 };
+  StoreSlot        slot       = { 0 };
+  gboolean         found      = FALSE;
+  g_autofree char *main_cache = NULL;
+  g_autofree char *path       = NULL;
+  g_autoptr (GFile) file      = NULL;
+
+  if (store_key_is_valid (unique_id_checksum))
+    {
+      if (!store_open (&store, files, FALSE, error))
+        return NULL;
+      if (!store_find (&store, unique_id_checksum, &slot, NULL, &found, error))
+        return NULL;
+      if (found)
+        return store_load (&store, &slot, error);
+      store_close (&store);
+    }
+
+  main_cache = bz_dup_module_dir ();
+  path       = g_build_filename (main_cache, unique_id_checksum, NULL);
+  file       = g_file_new_for_path (path);
+
+  return g_file_load_bytes (file, NULL, NULL, error);
+}
+
+/* Earlier versions kept every entry in its own file named after the
+ * checksum. Those are moved into the store once, before anything else
+ * touches the cache; whatever fails to move stays where it is and is
+ * still read from there. The app and the refresh worker both do this,
+ * so the directory is only listed under the exclusive lock, and files the
+ * other one moved in the meantime are skipped. */
+static void
+migrate_loose_entries (StoreFiles *files)
+{
+  g_auto (Store) store           = { 0 };
+  g_autoptr (GError) local_error = NULL;
+  g_autofree char *main_cache    = NULL;
+  g_autoptr (GDir) dir           = NULL;
+  guint migrated                 = 0;
+
+  main_cache = bz_dup_module_dir ();
+  if (!g_file_test (main_cache, G_FILE_TEST_IS_DIR))
+    return;
+
+  if (!store_open (&store, files, TRUE, &local_error))
+    {
+      g_warning ("Could not open the entry store to move cached entries into: %s",
+                 local_error->message);
+      return;
+    }
+
+  dir = g_dir_open (main_cache, 0, NULL);
+  if (dir == NULL)
+    return;
+
+  for (;;)
+    {
+      const char      *name     = NULL;
+      g_autofree char *path     = NULL;
+      g_autofree char *contents = NULL;
+      gsize            length   = 0;
+      g_autoptr (GBytes) bytes  = NULL;
+
+      name = g_dir_read_name (dir);
+      if (name == NULL)
+        break;
+      if (!store_key_is_valid (name))
+        continue;
+
+      path = g_build_filename (main_cache, name, NULL);
+      if (!g_file_get_contents (path, &contents, &length, &local_error))
+        {
+          if (!g_error_matches (local_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+            g_warning ("Could not read cached entry %s: %s", path, local_error->message);
+          g_clear_error (&local_error);
+          continue;
+        }
+      bytes = g_bytes_new_take (g_steal_pointer (&contents), length);
+
+      if (!store_put (&store, name, bytes, &local_error))
+        {
+          g_warning ("Could not move cached entry %s into the entry store: %s",
+                     path, local_error->message);
+          g_clear_error (&local_error);
+          continue;
+        }
+
+      g_unlink (path);
+      migrated++;
+    }
+
+  if (migrated > 0)
+    g_debug ("Moved %d cached entries into the entry store", migrated);
+}
+
+static void
+store_files_init (StoreFiles *files)
+{
+  files->dir      = bz_dup_module_dir ();
+  files->lock_fd  = -1;
+  files->index_fd = -1;
+  g_rw_lock_init (&files->rwlock);
+  g_mutex_init (&files->mutex);
+}
+
+static void
+store_files_clear (StoreFiles *files)
+{
+  if (files->dir == NULL)
+    return;
+
+  if (files->index_fd >= 0)
+    close (files->index_fd);
+  if (files->lock_fd >= 0)
+    close (files->lock_fd);
+  files->index_fd = -1;
+  files->lock_fd  = -1;
+  g_rw_lock_clear (&files->rwlock);
+  g_mutex_clear (&files->mutex);
+  g_clear_pointer (&files->dir, g_free);
+}
+
+/* Takes the flock, creating the lock file the first time, and makes sure
+ * `index_fd` is the index currently on disk, or -1 when there is none. The
+ * caller keeps other threads of this process out. */
+static gboolean
+store_files_lock (StoreFiles *files,
+                  gboolean    exclusive,
+                  GError    **error)
+{
+  g_autofree char *lock_path  = NULL;
+  g_autofree char *index_path = NULL;
+  struct stat      path_st    = { 0 };
+  struct stat      fd_st      = { 0 };
+
+  lock_path = g_build_filename (files->dir, STORE_LOCK_NAME, NULL);
+  if (files->lock_fd < 0)
+    {
+      if (g_mkdir_with_parents (files->dir, 0755) != 0)
+        return set_errno_error (error, errno, "create", files->dir);
+
+      files->lock_fd = open (lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+      if (files->lock_fd < 0)
+        return set_errno_error (error, errno, "open", lock_path);
+    }
+
+  while (flock (files->lock_fd, exclusive ? LOCK_EX : LOCK_SH) != 0)
+    {
+      if (errno != EINTR)
+        return set_errno_error (error, errno, "lock", lock_path);
+    }
+
+  /* another process may have replaced the index since we last held the
+     lock */
+  index_path = g_build_filename (files->dir, STORE_INDEX_NAME, NULL);
+  if (files->index_fd >= 0 &&
+      (stat (index_path, &path_st) != 0 ||
+       fstat (files->index_fd, &fd_st) != 0 ||
+       path_st.st_dev != fd_st.st_dev ||
+       path_st.st_ino != fd_st.st_ino))
+    {
+      close (files->index_fd);
+      files->index_fd = -1;
+    }
+
+  if (files->index_fd < 0)
+    {
+      files->index_fd = open (index_path, O_RDWR | O_CLOEXEC);
+      if (files->index_fd < 0 &&
+          errno != ENOENT)
+        {
+          int saved_errno = errno;
+
+          flock (files->lock_fd, LOCK_UN);
+          return set_errno_error (error, saved_errno, "open", index_path);
+        }
+    }
+
+  return TRUE;
+}
+
+/* Locks the store and reads its header. Readers of a store that was never
+ * written to see an empty one, and the first writer creates it. */
+static gboolean
+store_open (Store      *store,
+            StoreFiles *files,
+            gboolean    exclusive,
+            GError    **error)
+{
+  g_autofree char *index_path = NULL;
+  struct stat      st         = { 0 };
+  gboolean         valid      = FALSE;
+
+  store->files     = files;
+  store->exclusive = exclusive;
+
+  if (exclusive)
+    {
+      g_rw_lock_writer_lock (&files->rwlock);
+      store->locked = store_files_lock (files, TRUE, error);
+    }
+  else
+    {
+      /* the flock belongs to the descriptor, so it is taken by the first
+         reader in and dropped by the last one out */
+      g_rw_lock_reader_lock (&files->rwlock);
+      g_mutex_lock (&files->mutex);
+      store->locked = files->n_shared > 0 ||
+                      store_files_lock (files, FALSE, error);
+      if (store->locked)
+        files->n_shared++;
+      g_mutex_unlock (&files->mutex);
+    }
+  if (!store->locked)
+    return FALSE;
+
+  index_path = g_build_filename (files->dir, STORE_INDEX_NAME, NULL);
+  if (files->index_fd < 0)
+    {
+      if (exclusive)
+        return store_reset (store, error);
+
+      memset (&store->header, 0, sizeof (store->header));
+      return TRUE;
+    }
+
+  if (fstat (files->index_fd, &st) != 0)
+    return set_errno_error (error, errno, "inspect", index_path);
+
+  valid = st.st_size >= (goffset) sizeof (StoreHeader) &&
+          read_at (files->index_fd, &store->header, sizeof (store->header), 0, NULL) &&
+          memcmp (store->header.magic, STORE_INDEX_MAGIC, sizeof (store->header.magic)) == 0 &&
+          store->header.n_slots >= STORE_MIN_SLOTS &&
+          (store->header.n_slots & (store->header.n_slots - 1)) == 0 &&
+          st.st_size == (goffset) (sizeof (StoreHeader) +
+                                   (gsize) store->header.n_slots * sizeof (StoreSlot));
+  if (!valid)
+    {
+      /* readers see an empty store until the next writer starts over */
+      if (exclusive)
+        {
+          g_warning ("The entry store index at %s is damaged, starting over", index_path);
+          return store_reset (store, error);
+        }
+
+      g_debug ("The entry store index at %s is damaged, reading it as empty", index_path);
+      memset (&store->header, 0, sizeof (store->header));
+    }
+
+  return TRUE;
+}
+
+/* Safe to call more than once, or on a store that failed to open. The
+ * descriptors stay open for the next time. */
+static void
+store_close (Store *store)
+{
+  StoreFiles *files = store->files;
+
+  if (files == NULL)
+    return;
+
+  if (store->exclusive)
+    {
+      if (store->locked)
+        flock (files->lock_fd, LOCK_UN);
+      g_rw_lock_writer_unlock (&files->rwlock);
+    }
+  else
+    {
+      g_mutex_lock (&files->mutex);
+      if (store->locked &&
+          --files->n_shared == 0)
+        flock (files->lock_fd, LOCK_UN);
+      g_mutex_unlock (&files->mutex);
+      g_rw_lock_reader_unlock (&files->rwlock);
+    }
+
+  store->files  = NULL;
+  store->locked = FALSE;
+}
+
+static gboolean
+store_find (Store      *store,
+            const char *key,
+            StoreSlot  *slot_out,
+            guint32    *position_out,
+            gboolean   *found_out,
+            GError    **error)
+{
+  guint32 mask     = 0;
+  guint32 position = 0;
+
+  *found_out = FALSE;
+  if (store->header.n_slots == 0)
+    return TRUE;
+
+  mask     = store->header.n_slots - 1;
+  position = store_hash (key) & mask;
+  for (guint32 i = 0; i < store->header.n_slots; i++)
+    {
+      StoreSlot slot = { 0 };
+
+      if (!read_at (store->files->index_fd, &slot, sizeof (slot),
+                    sizeof (StoreHeader) + (goffset) position * sizeof (StoreSlot),
+                    error))
+        return FALSE;
+
+      if (slot.key[0] == '\0' ||
+          memcmp (slot.key, key, STORE_KEY_SIZE) == 0)
+        {
+          *found_out = slot.key[0] != '\0';
+          if (slot_out != NULL)
+            *slot_out = slot;
+          if (position_out != NULL)
+            *position_out = position;
+          return TRUE;
+        }
+
+      position = (position + 1) & mask;
+    }
+
+  g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+               "The entry store index has no free slots left");
+  return FALSE;
+}
+
+static GBytes *
+store_load (Store           *store,
+            const StoreSlot *slot,
+            GError         **error)
+{
+  g_autofree char *path  = NULL;
+  int              fd    = -1;
+  g_autoptr (GBytes) ret = NULL;
+
+  path = store_segment_path (store, slot->segment);
+  fd   = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    {
+      set_errno_error (error, errno, "open", path);
+      return NULL;
+    }
+
+  ret = store_read_record (fd, path, slot, error);
+  close (fd);
+
+  return g_steal_pointer (&ret);
+}
+
+/* Reads the record `slot` points to out of `fd`, the segment at `path` */
+static GBytes *
+store_read_record (int              fd,
+                   const char      *path,
+                   const StoreSlot *slot,
+                   GError         **error)
+{
+  StoreRecord        record = { 0 };
+  g_autofree guint8 *data   = NULL;
+
+  if (!read_at (fd, &record, sizeof (record), slot->offset, error))
+    return NULL;
+  if (record.magic != STORE_RECORD_MAGIC ||
+      record.length != slot->length ||
+      memcmp (record.key, slot->key, STORE_KEY_SIZE) != 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "The record at offset %" G_GUINT64_FORMAT " of %s is damaged",
+                   (guint64) slot->offset, path);
+      return NULL;
+    }
+
+  data = g_malloc (MAX (record.length, 1));
+  if (!read_at (fd, data, record.length, slot->offset + sizeof (record), error))
+    return NULL;
+
+  return g_bytes_new_take (g_steal_pointer (&data), record.length);
+}
+
+/* Appends `bytes` as the latest version of `key`, unless it is already
+ * stored exactly like that. Needs the exclusive lock. */
+static gboolean
+store_put (Store      *store,
+           const char *key,
+           GBytes     *bytes,
+           GError    **error)
+{
+  StoreSlot        slot         = { 0 };
+  guint32          position     = 0;
+  gboolean         found        = FALSE;
+  gsize            size         = 0;
+  gconstpointer    data         = NULL;
+  StoreRecord      record       = { 0 };
+  g_autofree char *path         = NULL;
+  int              fd           = -1;
+  struct stat      st           = { 0 };
+  g_autoptr (GByteArray) buffer = NULL;
+  gboolean result               = FALSE;
+  gboolean grow                 = FALSE;
+  gboolean compact              = FALSE;
+
+  data = g_bytes_get_data (bytes, &size);
+  if (size > G_MAXUINT32)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                   "Entry is too large for the entry store");
+      return FALSE;
+    }
+
+  if (!store_find (store, key, &slot, &position, &found, error))
+    return FALSE;
+
+  if (found && slot.length == size)
+    {
+      g_autoptr (GBytes) existing = NULL;
+
+      existing = store_load (store, &slot, NULL);
+      if (existing != NULL && g_bytes_equal (existing, bytes))
+        return TRUE;
+    }
+
+  record.magic  = STORE_RECORD_MAGIC;
+  record.length = size;
+  memcpy (record.key, key, STORE_KEY_SIZE);
+
+  buffer = g_byte_array_sized_new (sizeof (record) + size);
+  g_byte_array_append (buffer, (const guint8 *) &record, sizeof (record));
+  g_byte_array_append (buffer, data, size);
+
+  path = store_segment_path (store, store->header.segment);
+  fd   = open (path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return set_errno_error (error, errno, "open", path);
+  if (fstat (fd, &st) != 0)
+    {
+      set_errno_error (error, errno, "inspect", path);
+      close (fd);
+      return FALSE;
+    }
+
+  if (st.st_size > 0 &&
+      st.st_size + buffer->len > STORE_SEGMENT_SIZE)
+    {
+      close (fd);
+
+      /* the index must never point past the segment it records, or a
+       * later compaction could truncate live records */
+      store->header.segment++;
+      if (!write_at (store->files->index_fd, &store->header, sizeof (store->header), 0, error))
+        return FALSE;
+
+      g_free (path);
+      path = store_segment_path (store, store->header.segment);
+      fd   = open (path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+      if (fd < 0)
+        return set_errno_error (error, errno, "open", path);
+      if (fstat (fd, &st) != 0)
+        {
+          set_errno_error (error, errno, "inspect", path);
+          close (fd);
+          return FALSE;
+        }
+    }
+
+  result = write_all (fd, buffer->data, buffer->len, error);
+  close (fd);
+  if (!result)
+    return FALSE;
+
+  if (found)
+    {
+      store->header.live_bytes -= sizeof (StoreRecord) + slot.length;
+      store->header.dead_bytes += sizeof (StoreRecord) + slot.length;
+    }
+  else
+    store->header.n_used++;
+  store->header.live_bytes += buffer->len;
+
+  memcpy (slot.key, key, STORE_KEY_SIZE);
+  slot.segment = store->header.segment;
+  slot.length  = size;
+  slot.offset  = st.st_size;
+
+  if (!write_at (store->files->index_fd, &slot, sizeof (slot),
+                 sizeof (StoreHeader) + (goffset) position * sizeof (StoreSlot),
+                 error) ||
+      !write_at (store->files->index_fd, &store->header, sizeof (store->header), 0, error))
+    return FALSE;
+
+  grow    = (guint64) store->header.n_used * 2 > store->header.n_slots;
+  compact = store->header.dead_bytes >= STORE_COMPACT_MIN &&
+            store->header.dead_bytes > store->header.live_bytes;
+  if (grow || compact)
+    return store_rebuild (
+        store,
+        grow ? store->header.n_slots * 2 : store->header.n_slots,
+        compact, error);
+
+  return TRUE;
+}
+
+static gboolean
+store_collect_keys (Store      *store,
+                    GHashTable *set,
+                    GError    **error)
+{
+  g_autofree StoreSlot *slots = NULL;
+
+  if (store->header.n_slots == 0)
+    return TRUE;
+
+  slots = g_new (StoreSlot, store->header.n_slots);
+  if (!read_at (store->files->index_fd, slots,
+                (gsize) store->header.n_slots * sizeof (StoreSlot),
+                sizeof (StoreHeader), error))
+    return FALSE;
+
+  for (guint32 i = 0; i < store->header.n_slots; i++)
+    {
+      if (slots[i].key[0] != '\0')
+        g_hash_table_replace (set, g_strndup (slots[i].key, STORE_KEY_SIZE), NULL);
+    }
+
+  return TRUE;
+}
+
+/* Throws away everything in the store and writes an empty index */
+static gboolean
+store_reset (Store   *store,
+             GError **error)
+{
+  StoreHeader           header = { 0 };
+  g_autofree StoreSlot *slots  = NULL;
+
+  memcpy (header.magic, STORE_INDEX_MAGIC, sizeof (header.magic));
+  header.n_slots       = STORE_MIN_SLOTS;
+  header.segment       = 1;
+  header.first_segment = 1;
+
+  store_remove_segments (store, 1, 0);
+
+  slots = g_new0 (StoreSlot, header.n_slots);
+  return store_write_index (store, &header, slots, error);
+}
+
+/* Rehashes the index into `n_slots` slots. When compacting, the live
+ * records are also copied into fresh segments in the order they sit on
+ * disk, each old segment read through a single descriptor, in large
+ * writes, and the old segments are dropped afterwards. Records that turn
+ * out to be damaged are left behind. */
+static gboolean
+store_rebuild (Store   *store,
+               guint32  n_slots,
+               gboolean compact,
+               GError **error)
+{
+  StoreHeader           header = { 0 };
+  g_autofree StoreSlot *old    = NULL;
+  g_autofree StoreSlot *slots  = NULL;
+  g_autoptr (GArray) live      = NULL;
+  g_autoptr (GByteArray) chunk = NULL;
+  g_autofree char *path        = NULL;
+  int              fd          = -1;
+  g_autofree char *read_path   = NULL;
+  int              read_fd     = -1;
+  guint32          read_seg    = 0;
+  guint64          written     = 0;
+  gboolean         result      = FALSE;
+
+  old = g_new (StoreSlot, store->header.n_slots);
+  if (!read_at (store->files->index_fd, old,
+                (gsize) store->header.n_slots * sizeof (StoreSlot),
+                sizeof (StoreHeader), error))
+    return FALSE;
+
+  live = g_array_sized_new (FALSE, FALSE, sizeof (StoreSlot), store->header.n_used);
+  for (guint32 i = 0; i < store->header.n_slots; i++)
+    {
+      if (old[i].key[0] != '\0')
+        g_array_append_val (live, old[i]);
+    }
+  g_clear_pointer (&old, g_free);
+
+  header         = store->header;
+  header.n_slots = n_slots;
+  header.n_used  = 0;
+  slots          = g_new0 (StoreSlot, n_slots);
+
+  if (compact)
+    {
+      g_array_sort (live, cmp_slots);
+
+      header.segment       = store->header.segment + 1;
+      header.first_segment = header.segment;
+      header.live_bytes    = 0;
+      header.dead_bytes    = 0;
+      chunk                = g_byte_array_sized_new (STORE_WRITE_CHUNK);
+    }
+
+  for (guint i = 0; i < live->len; i++)
+    {
+      StoreSlot slot = { 0 };
+
+      slot = g_array_index (live, StoreSlot, i);
+      if (compact)
+        {
+          g_autoptr (GError) local_error = NULL;
+          g_autoptr (GBytes) bytes       = NULL;
+          StoreRecord record             = { 0 };
+          gsize       record_size        = 0;
+
+          /* `live` is in disk order, so each segment is opened once */
+          if (read_fd < 0 ||
+              read_seg != slot.segment)
+            {
+              if (read_fd >= 0)
+                close (read_fd);
+              read_seg = slot.segment;
+              g_free (read_path);
+              read_path = store_segment_path (store, read_seg);
+              read_fd   = open (read_path, O_RDONLY | O_CLOEXEC);
+              if (read_fd < 0)
+                {
+                  set_errno_error (error, errno, "open", read_path);
+                  goto done;
+                }
+            }
+
+          bytes = store_read_record (read_fd, read_path, &slot, &local_error);
+          if (bytes == NULL)
+            {
+              if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA))
+                {
+                  g_propagate_error (error, g_steal_pointer (&local_error));
+                  goto done;
+                }
+              g_warning ("Dropping cached entry %.*s: %s",
+                         STORE_KEY_SIZE, slot.key, local_error->message);
+              continue;
+            }
+          record_size = sizeof (record) + slot.length;
+
+          if (fd >= 0 &&
+              written + record_size > STORE_SEGMENT_SIZE)
+            {
+              if (!write_all (fd, chunk->data, chunk->len, error))
+                goto done;
+              g_byte_array_set_size (chunk, 0);
+              if (fsync (fd) != 0)
+                {
+                  set_errno_error (error, errno, "sync", path);
+                  goto done;
+                }
+              close (fd);
+              fd      = -1;
+              written = 0;
+              header.segment++;
+            }
+          if (fd < 0)
+            {
+              g_free (path);
+              path = store_segment_path (store, header.segment);
+              fd   = open (path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+              if (fd < 0)
+                {
+                  set_errno_error (error, errno, "create", path);
+                  goto done;
+                }
+            }
+
+          record.magic  = STORE_RECORD_MAGIC;
+          record.length = slot.length;
+          memcpy (record.key, slot.key, STORE_KEY_SIZE);
+          g_byte_array_append (chunk, (const guint8 *) &record, sizeof (record));
+          g_byte_array_append (chunk, g_bytes_get_data (bytes, NULL), slot.length);
+
+          slot.segment = header.segment;
+          slot.offset  = written;
+          written += record_size;
+          header.live_bytes += record_size;
+
+          if (chunk->len >= STORE_WRITE_CHUNK)
+            {
+              if (!write_all (fd, chunk->data, chunk->len, error))
+                goto done;
+              g_byte_array_set_size (chunk, 0);
+            }
+        }
+
+      /* open addressing, so the slot goes into the first free one after
+       * where it hashes to */
+      for (guint32 position = store_hash (slot.key) & (n_slots - 1);;
+           position = (position + 1) & (n_slots - 1))
+        {
+          if (slots[position].key[0] == '\0')
+            {
+              slots[position] = slot;
+              break;
+            }
+        }
+      header.n_used++;
+    }
+
+  if (fd >= 0)
+    {
+      if (!write_all (fd, chunk->data, chunk->len, error))
+        goto done;
+      if (fsync (fd) != 0)
+        {
+          set_errno_error (error, errno, "sync", path);
+          goto done;
+        }
+    }
+
+  if (!store_write_index (store, &header, slots, error))
+    goto done;
+
+  if (compact)
+    store_remove_segments (store, header.first_segment, header.segment);
+  result = TRUE;
+
+done:
+  if (fd >= 0)
+    close (fd);
+  if (read_fd >= 0)
+    close (read_fd);
+  return result;
+}
+
+/* Replaces the index as a whole and reopens it */
+static gboolean
+store_write_index (Store             *store,
+                   const StoreHeader *header,
+                   const StoreSlot   *slots,
+                   GError           **error)
+{
+  g_autofree char *index_path   = NULL;
+  g_autoptr (GByteArray) buffer = NULL;
+
+  index_path = g_build_filename (store->files->dir, STORE_INDEX_NAME, NULL);
+
+  buffer = g_byte_array_sized_new (sizeof (*header) + (gsize) header->n_slots * sizeof (*slots));
+  g_byte_array_append (buffer, (const guint8 *) header, sizeof (*header));
+  g_byte_array_append (buffer, (const guint8 *) slots, (gsize) header->n_slots * sizeof (*slots));
+
+  if (!g_file_set_contents_full (
+          index_path,
+          (const char *) buffer->data,
+          buffer->len,
+          G_FILE_SET_CONTENTS_CONSISTENT,
+          0644,
+          error))
+    return FALSE;
+
+  if (store->files->index_fd >= 0)
+    close (store->files->index_fd);
+  store->files->index_fd = open (index_path, O_RDWR | O_CLOEXEC);
+  if (store->files->index_fd < 0)
+    return set_errno_error (error, errno, "open", index_path);
+
+  store->header = *header;
+  return TRUE;
+}
+
+/* Deletes every segment outside of `keep_first` to `keep_last`, which also
+ * picks up the leftovers of a compaction that was interrupted */
+static void
+store_remove_segments (Store  *store,
+                       guint32 keep_first,
+                       guint32 keep_last)
+{
+  g_autoptr (GDir) dir = NULL;
+
+  dir = g_dir_open (store->files->dir, 0, NULL);
+  if (dir == NULL)
+    return;
+
+  for (;;)
+    {
+      const char      *name    = NULL;
+      const char      *number  = NULL;
+      guint64          segment = 0;
+      char            *end     = NULL;
+      g_autofree char *path    = NULL;
+
+      name = g_dir_read_name (dir);
+      if (name == NULL)
+        break;
+      if (!g_str_has_prefix (name, STORE_SEGMENT_PREFIX))
+        continue;
+
+      number = name + strlen (STORE_SEGMENT_PREFIX);
+      if (strlen (number) != 8 ||
+          !g_ascii_isdigit (*number))
+        continue;
+      segment = g_ascii_strtoull (number, &end, 10);
+      if (*end != '\0' ||
+          (segment >= keep_first && segment <= keep_last))
+        continue;
+
+      path = g_build_filename (store->files->dir, name, NULL);
+      g_unlink (path);
+    }
+}
+
+static char *
+store_segment_path (Store  *store,
+                    guint32 segment)
+{
+  g_autofree char *basename = NULL;
+
+  basename = g_strdup_printf (STORE_SEGMENT_PREFIX "%08u", segment);
+  return g_build_filename (store->files->dir, basename, NULL);
+}
+
+/* Keys are MD5 checksums in hex, which is also what the old layout named
+ * its files */
+static gboolean
+store_key_is_valid (const char *key)
+{
+  guint i = 0;
+
+  for (i = 0; key[i] != '\0'; i++)
+    {
+      if (i >= STORE_KEY_SIZE ||
+          !g_ascii_isxdigit (key[i]))
+        return FALSE;
+    }
+
+  return i == STORE_KEY_SIZE;
+}
+
+/* FNV-1a */
+static guint32
+store_hash (const char *key)
+{
+  guint32 hash = 2166136261u;
+
+  for (guint i = 0; i < STORE_KEY_SIZE; i++)
+    {
+      hash ^= (guint8) key[i];
+      hash *= 16777619u;
+    }
+
+  return hash;
+}
+
+static gint
+cmp_slots (gconstpointer a,
+           gconstpointer b)
+{
+  const StoreSlot *sa = a;
+  const StoreSlot *sb = b;
+
+  if (sa->segment != sb->segment)
+    return (sa->segment > sb->segment) - (sa->segment < sb->segment);
+  return (sa->offset > sb->offset) - (sa->offset < sb->offset);
+}
+
+static gboolean
+read_at (int      fd,
+         gpointer buf,
+         gsize    size,
+         goffset  offset,
+         GError **error)
+{
+  gsize done = 0;
+
+  while (done < size)
+    {
+      gssize n = 0;
+
+      n = pread (fd, (guint8 *) buf + done, size - done, offset + done);
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return set_errno_error (error, errno, "read", "the entry store");
+        }
+      if (n == 0)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                       "The entry store ends unexpectedly");
+          return FALSE;
+        }
+      done += n;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+write_at (int           fd,
+          gconstpointer buf,
+          gsize         size,
+          goffset       offset,
+          GError      **error)
+{
+  gsize done = 0;
+
+  while (done < size)
+    {
+      gssize n = 0;
+
+      n = pwrite (fd, (const guint8 *) buf + done, size - done, offset + done);
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return set_errno_error (error, errno, "write", "the entry store");
+        }
+      done += n;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+write_all (int           fd,
+           gconstpointer buf,
+           gsize         size,
+           GError      **error)
+{
+  gsize done = 0;
+
+  while (done < size)
+    {
+      gssize n = 0;
+
+      n = write (fd, (const guint8 *) buf + done, size - done);
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return set_errno_error (error, errno, "write", "the entry store");
+        }
+      done += n;
+    }
+
+  return TRUE;
+}
+
+/* Always returns FALSE, so it can end a failing function */
+static gboolean
+set_errno_error (GError    **error,
+                 int         saved_errno,
+                 const char *what,
+                 const char *path)
+{
+  g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+               "Could not %s %s: %s", what, path, g_strerror (saved_errno));
+  return FALSE;
+}
+
 /* End of bz-entry-cache-manager.c */
@@ -110,6 +110,7 @@ enum
   PROP_IS_FLATHUB,
   PROP_IS_VERIFIED,
   PROP_SEARCH_TOKENS,
+  PROP_SEARCHABLE,
   PROP_UI_ENTRY,
   PROP_EOL,
   PROP_INSTALLED_SIZE,
@@ -233,6 +234,9 @@ bz_entry_group_get_property (GObject    *object,
     case PROP_SEARCH_TOKENS:
       g_value_set_boxed (value, bz_entry_group_get_search_tokens (self));
       break;
+    case PROP_SEARCHABLE:
+      g_value_set_boolean (value, bz_entry_group_is_searchable (self));
+      break;
     case PROP_EOL:
       g_value_set_string (value, bz_entry_group_get_eol (self));
       break;
@@ -303,6 +307,7 @@ bz_entry_group_set_property (GObject      *object,
     case PROP_IS_FLATHUB:
     case PROP_IS_VERIFIED:
     case PROP_SEARCH_TOKENS:
+    case PROP_SEARCHABLE:
     case PROP_EOL:
     case PROP_UI_ENTRY:
     case PROP_INSTALLABLE:
@@ -416,6 +421,12 @@ bz_entry_group_class_init (BzEntryGroupClass *klass)
           NULL, NULL, NULL,
           G_PARAM_READABLE);
 
+  props[PROP_SEARCHABLE] =
+      g_param_spec_boolean (
+          "searchable",
+          NULL, NULL, FALSE,
+          G_PARAM_READABLE);
+
   props[PROP_EOL] =
       g_param_spec_string (
           "eol",
@@ -1249,8 +1260,11 @@ bz_entry_group_add (BzEntryGroup *self,
   else
     g_array_append_val (self->state_flags, state_flags);
 
-  if (!is_addon && is_searchable)
-    self->searchable = TRUE;
+  if (!is_addon && is_searchable && !self->searchable)
+    {
+      self->searchable = TRUE;
+      g_object_notify_by_pspec (G_OBJECT (self), props[PROP_SEARCHABLE]);
+    }
 }
 
 void
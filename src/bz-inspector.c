@@ -26,11 +26,31 @@
 
 #include "bz-entry-inspector.h"
 #include "env.h"
+#include "bz-finished-search-query.h"
 #include "bz-inspector.h"
 #include "bz-serializable.h"
 #include "template-callbacks.h"
 #include "bz-window.h"
 
+/* Upper bounds of the search latency histogram, doubling each time. The
+ * last bucket takes everything slower. */
+static const struct
+{
+  double      upper;
+  const char *label;
+} latency_buckets[] = {
+  {      0.001,   "< 1 ms" },
+  {      0.002,   "< 2 ms" },
+  {      0.004,   "< 4 ms" },
+  {      0.008,   "< 8 ms" },
+  {      0.016,  "< 16 ms" },
+  {      0.032,  "< 32 ms" },
+  {      0.064,  "< 64 ms" },
+  {      0.128, "< 128 ms" },
+  {      0.256, "< 256 ms" },
+  { G_MAXDOUBLE, "≥ 256 ms" },
+};
+
 struct _BzInspector
 {
   AdwWindow parent_instance;
@@ -49,6 +69,12 @@ struct _BzInspector
   GtkEditable        *search_entry;
   GtkFilterListModel *filter_model;
   GtkSingleSelection *groups_selection;
+  GtkGrid            *search_latency_grid;
+  GtkLabel           *search_phases_label;
+
+  BzSearchEngine *search_engine;
+  GtkLevelBar    *latency_bars[G_N_ELEMENTS (latency_buckets)];
+  GtkLabel       *latency_counts[G_N_ELEMENTS (latency_buckets)];
 };
 
 G_DEFINE_FINAL_TYPE (BzInspector, bz_inspector, ADW_TYPE_WINDOW);
@@ -70,11 +96,37 @@ static gboolean
 filter_func (BzEntryGroup *group,
              BzInspector  *self);
 
+static void
+search_engine_changed (BzInspector *self,
+                       GParamSpec  *pspec,
+                       BzStateInfo *state);
+
+static void
+recent_queries_changed (BzInspector *self,
+                        guint        position,
+                        guint        removed,
+                        guint        added,
+                        GListModel  *model);
+
+static void
+update_search_latency (BzInspector *self);
+
+static gint
+cmp_double (gconstpointer a,
+            gconstpointer b);
+
 static void
 bz_inspector_dispose (GObject *object)
 {
   BzInspector *self = BZ_INSPECTOR (object);
 
+  if (self->state != NULL)
+    g_signal_handlers_disconnect_by_func (self->state, search_engine_changed, self);
+  if (self->search_engine != NULL)
+    g_signal_handlers_disconnect_by_func (
+        bz_search_engine_get_recent_queries (self->search_engine),
+        recent_queries_changed, self);
+  g_clear_object (&self->search_engine);
   g_clear_pointer (&self->state, g_object_unref);
 
   g_clear_object (&self->debug_mode_binding);
@@ -289,6 +341,8 @@ bz_inspector_class_init (BzInspectorClass *klass)
   gtk_widget_class_bind_template_child (widget_class, BzInspector, search_entry);
   gtk_widget_class_bind_template_child (widget_class, BzInspector, filter_model);
   gtk_widget_class_bind_template_child (widget_class, BzInspector, groups_selection);
+  gtk_widget_class_bind_template_child (widget_class, BzInspector, search_latency_grid);
+  gtk_widget_class_bind_template_child (widget_class, BzInspector, search_phases_label);
   gtk_widget_class_bind_template_callback (widget_class, serialize_all_entries_cb);
   gtk_widget_class_bind_template_callback (widget_class, preview_changed);
   gtk_widget_class_bind_template_callback (widget_class, selected_group_changed);
@@ -325,6 +379,35 @@ bz_inspector_init (BzInspector *self)
   gtk_editable_set_text (
       self->serialize_all_entries_path_entry,
       serialize_all_entries_output);
+
+  for (guint i = 0; i < G_N_ELEMENTS (latency_buckets); i++)
+    {
+      GtkWidget *label = NULL;
+      GtkWidget *bar   = NULL;
+      GtkWidget *count = NULL;
+
+      label = gtk_label_new (latency_buckets[i].label);
+      gtk_label_set_xalign (GTK_LABEL (label), 1.0);
+
+      bar = gtk_level_bar_new ();
+      gtk_widget_set_hexpand (bar, TRUE);
+      gtk_widget_set_valign (bar, GTK_ALIGN_CENTER);
+      /* the offsets would color the bars by how full they are */
+      gtk_level_bar_remove_offset_value (GTK_LEVEL_BAR (bar), GTK_LEVEL_BAR_OFFSET_LOW);
+      gtk_level_bar_remove_offset_value (GTK_LEVEL_BAR (bar), GTK_LEVEL_BAR_OFFSET_HIGH);
+      gtk_level_bar_remove_offset_value (GTK_LEVEL_BAR (bar), GTK_LEVEL_BAR_OFFSET_FULL);
+
+      count = gtk_label_new ("0");
+      gtk_label_set_xalign (GTK_LABEL (count), 0.0);
+
+      gtk_grid_attach (self->search_latency_grid, label, 0, i, 1, 1);
+      gtk_grid_attach (self->search_latency_grid, bar, 1, i, 1, 1);
+      gtk_grid_attach (self->search_latency_grid, count, 2, i, 1, 1);
+
+      self->latency_bars[i]   = GTK_LEVEL_BAR (bar);
+      self->latency_counts[i] = GTK_LABEL (count);
+    }
+  update_search_latency (self);
 }
 
 BzInspector *
@@ -346,6 +429,8 @@ bz_inspector_set_state (BzInspector *self,
 {
   g_return_if_fail (BZ_IS_INSPECTOR (self));
 
+  if (self->state != NULL)
+    g_signal_handlers_disconnect_by_func (self->state, search_engine_changed, self);
   g_clear_pointer (&self->state, g_object_unref);
   g_clear_pointer (&self->debug_mode_binding, g_object_unref);
   g_clear_pointer (&self->disable_blocklists_binding, g_object_unref);
@@ -361,7 +446,12 @@ bz_inspector_set_state (BzInspector *self,
           state, "disable-blocklists",
           self->disable_blocklists_check, "active",
           G_BINDING_BIDIRECTIONAL | G_BINDING_SYNC_CREATE);
+
+      g_signal_connect_swapped (
+          state, "notify::search-engine",
+          G_CALLBACK (search_engine_changed), self);
     }
+  search_engine_changed (self, NULL, state);
 
   g_object_notify_by_pspec (G_OBJECT (self), props[PROP_STATE]);
 }
@@ -525,4 +615,140 @@ filter_func (BzEntryGroup *group,
   return FALSE;
 }
 
+static void
+search_engine_changed (BzInspector *self,
+                       GParamSpec  *pspec,
+                       BzStateInfo *state)
+{
+  BzSearchEngine *engine = NULL;
+
+  if (self->search_engine != NULL)
+    g_signal_handlers_disconnect_by_func (
+        bz_search_engine_get_recent_queries (self->search_engine),
+        recent_queries_changed, self);
+  g_clear_object (&self->search_engine);
+
+  if (state != NULL)
+    engine = bz_state_info_get_search_engine (state);
+  if (engine != NULL)
+    {
+      self->search_engine = g_object_ref (engine);
+      g_signal_connect_swapped (
+          bz_search_engine_get_recent_queries (engine),
+          "items-changed", G_CALLBACK (recent_queries_changed), self);
+    }
+
+  update_search_latency (self);
+}
+
+static void
+recent_queries_changed (BzInspector *self,
+                        guint        position,
+                        guint        removed,
+                        guint        added,
+                        GListModel  *model)
+{
+  update_search_latency (self);
+}
+
+/* Sorts the recent queries into the histogram buckets by how long the
+ * first results took, and sums up where that time went */
+static void
+update_search_latency (BzInspector *self)
+{
+  GListModel *recent                                 = NULL;
+  guint       n_queries                              = 0;
+  guint       counts[G_N_ELEMENTS (latency_buckets)] = { 0 };
+  guint       max_count                              = 0;
+  double      snapshot                               = 0.0;
+  double      bias                                   = 0.0;
+  double      scan                                   = 0.0;
+  double      sort                                   = 0.0;
+  double      build                                  = 0.0;
+  guint       n_scanned                              = 0;
+  guint       n_matched                              = 0;
+  g_autoptr (GArray) latencies                       = NULL;
+  g_autofree char *phases                            = NULL;
+
+  if (self->search_engine != NULL)
+    {
+      recent    = bz_search_engine_get_recent_queries (self->search_engine);
+      n_queries = g_list_model_get_n_items (recent);
+    }
+
+  latencies = g_array_sized_new (FALSE, FALSE, sizeof (double), n_queries);
+  for (guint i = 0; i < n_queries; i++)
+    {
+      g_autoptr (BzFinishedSearchQuery) query = NULL;
+      double elapsed                          = 0.0;
+      guint  bucket                           = 0;
+
+      query   = g_list_model_get_item (recent, i);
+      elapsed = bz_finished_search_query_get_elapsed (query);
+      g_array_append_val (latencies, elapsed);
+
+      while (elapsed >= latency_buckets[bucket].upper)
+        bucket++;
+      counts[bucket]++;
+      max_count = MAX (max_count, counts[bucket]);
+
+      snapshot += bz_finished_search_query_get_snapshot_elapsed (query);
+      bias += bz_finished_search_query_get_bias_elapsed (query);
+      scan += bz_finished_search_query_get_scan_elapsed (query);
+      sort += bz_finished_search_query_get_sort_elapsed (query);
+      build += bz_finished_search_query_get_build_elapsed (query);
+      n_scanned += bz_finished_search_query_get_n_scanned (query);
+      n_matched += bz_finished_search_query_get_n_matched (query);
+    }
+
+  for (guint i = 0; i < G_N_ELEMENTS (latency_buckets); i++)
+    {
+      g_autofree char *count = NULL;
+
+      count = g_strdup_printf ("%u", counts[i]);
+      gtk_label_set_label (self->latency_counts[i], count);
+      gtk_level_bar_set_value (
+          self->latency_bars[i],
+          max_count > 0 ? (double) counts[i] / (double) max_count : 0.0);
+    }
+
+  if (n_queries == 0)
+    {
+      gtk_label_set_label (self->search_phases_label, "No searches yet");
+      return;
+    }
+
+  g_array_sort (latencies, cmp_double);
+
+#define AVERAGE_MS(_total) ((_total) * 1000.0 / (double) n_queries)
+  phases = g_strdup_printf (
+      "%u queries, median %.2f ms, 95th percentile %.2f ms\n"
+      "Average per phase: snapshot %.2f ms, biases %.2f ms, "
+      "scan %.2f ms, sort %.2f ms, build %.2f ms\n"
+      "Average groups scanned %u, matched %u",
+      n_queries,
+      g_array_index (latencies, double, n_queries / 2) * 1000.0,
+      g_array_index (latencies, double, (n_queries * 95) / 100) * 1000.0,
+      AVERAGE_MS (snapshot),
+      AVERAGE_MS (bias),
+      AVERAGE_MS (scan),
+      AVERAGE_MS (sort),
+      AVERAGE_MS (build),
+      n_scanned / n_queries,
+      n_matched / n_queries);
+#undef AVERAGE_MS
+
+  gtk_label_set_label (self->search_phases_label, phases);
+}
+
+static gint
+cmp_double (gconstpointer a,
+            gconstpointer b)
+{
+  double da = *(const double *) a;
+  double db = *(const double *) b;
+
+  return (da > db) - (da < db);
+}
+
 /* End of bz-inspector.c */
@@ -78,6 +78,7 @@ struct _BzPreferencesDialog
   AdwSwitchRow   *only_verified_switch;
   GtkFlowBox     *flag_buttons_box;
   AdwSwitchRow   *hide_eol_switch;
+  AdwSwitchRow   *typo_tolerance_switch;
 
   GtkToggleButton *flag_buttons[G_N_ELEMENTS (bar_themes)];
 };
@@ -207,6 +208,10 @@ bind_settings (BzPreferencesDialog *self)
                    self->hide_eol_switch, "active",
                    G_SETTINGS_BIND_DEFAULT);
 
+  g_settings_bind (self->settings, "search-typo-tolerance",
+                   self->typo_tolerance_switch, "active",
+                   G_SETTINGS_BIND_DEFAULT);
+
   g_settings_bind (self->settings, "auto-update",
                    self->automatic_updates_check, "active",
                    G_SETTINGS_BIND_DEFAULT);
@@ -391,6 +396,7 @@ bz_preferences_dialog_class_init (BzPreferencesDialogClass *klass)
   gtk_widget_class_bind_template_child (widget_class, BzPreferencesDialog, only_verified_switch);
   gtk_widget_class_bind_template_child (widget_class, BzPreferencesDialog, flag_buttons_box);
   gtk_widget_class_bind_template_child (widget_class, BzPreferencesDialog, hide_eol_switch);
+  gtk_widget_class_bind_template_child (widget_class, BzPreferencesDialog, typo_tolerance_switch);
   gtk_widget_class_bind_template_child (widget_class, BzPreferencesDialog, automatic_updates_check);
   gtk_widget_class_bind_template_child (widget_class, BzPreferencesDialog, auto_notif_switch);
   gtk_widget_class_bind_template_callback (widget_class, auto_updates_toggled_cb);
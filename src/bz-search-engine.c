@@ -20,13 +20,286 @@
 
 #define G_LOG_DOMAIN "BAZAAR::SEARCH-ENGINE"
 
+#include <stdlib.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_X86_FIND_KERNELS
+#endif
+
 #include "bz-search-engine.h"
 #include "bz-entry-group.h"
 #include "bz-finished-search-query.h"
-#include "bz-search-result.h"
+#include "bz-search-results.h"
 #include "env.h"
 #include "util.h"
 
+/* how many entries a sub task claims at a time; it checks for
+ * cancellation before each claim */
+#define WORK_CHUNK_SIZE 256
+
+/* how many of the best results are ranked and delivered before the rest,
+ * which is about what fits on the first screen */
+#define HEAD_SIZE 50
+
+/* Below this many results the query is tried again with typos allowed, if
+ * the engine is set up for that. The second pass scans the whole corpus
+ * with a costlier matcher, so queries that find plenty never pay for it. */
+#define FUZZY_MAX_RESULTS 5
+
+/* query tokens shorter than this have to match exactly, since one edit on
+ * a handful of characters matches nearly anything */
+#define FUZZY_MIN_CHARS 4
+
+/* how many finished queries the engine remembers for the inspector */
+#define RECENT_QUERIES 256
+
+/* Queries this short are ranked ahead of time, since they match much of
+ * the catalog and are the first thing anybody types */
+#define PREFIX_TABLE_MAX_CHARS 2
+
+/* below this many matches the index already makes a query cheap, so the
+ * table does not spend memory on it */
+#define PREFIX_TABLE_MIN_MATCHES 256
+
+#define USEC_TO_SEC(_usec) ((double) (_usec) / (double) G_USEC_PER_SEC)
+
+enum
+{
+  FIELD_TITLE,
+  FIELD_DEVELOPER,
+  FIELD_DESCRIPTION,
+  FIELD_SEARCH_TOKENS,
+  N_FIELDS,
+};
+
+static const struct
+{
+  double weight;
+  gssize accept_min_size;
+} field_scoring[N_FIELDS] = {
+  [FIELD_TITLE]         = { 2.0, 2 },
+  [FIELD_DEVELOPER]     = { 1.0, 2 },
+  [FIELD_DESCRIPTION]   = { 1.0, 3 },
+  [FIELD_SEARCH_TOKENS] = { 1.5, -1 },
+};
+
+/* NUL terminated strings packed back to back, one per entry, with absent
+ * ones at G_MAXUINT32 */
+typedef struct
+{
+  GByteArray *arena;
+  GArray     *offsets;
+} StringColumn;
+
+/* Lowercased text split on space separators. Token `t` starts at
+ * `token_offsets[t]` in `arena` and is NUL terminated, and the tokens of
+ * entry `i` are those from `entry_tokens[i]` up to `entry_tokens[i + 1]`. */
+typedef struct
+{
+  GByteArray *arena;
+  GArray     *token_offsets;
+  GArray     *token_bytes;
+  GArray     *token_chars;
+  GArray     *entry_tokens;
+} TokenColumn;
+
+static void
+string_column_init (StringColumn *column);
+
+static void
+string_column_clear (StringColumn *column);
+
+static void
+string_column_append (StringColumn *column,
+                      const char   *str);
+
+static inline const char *
+string_column_get (const StringColumn *column,
+                   guint               idx);
+
+static void
+token_column_init (TokenColumn *column);
+
+static void
+token_column_clear (TokenColumn *column);
+
+static void
+token_column_append (TokenColumn *column,
+                     const char  *str);
+
+static void
+corpus_clear (gpointer ptr);
+
+/* What a query needs to know about each group, copied out once per model
+ * change so the search threads never have to take the group's lock. That
+ * includes groups that are updated in place, which notify instead of
+ * going through items-changed. Immutable once build_corpus_fiber () has
+ * filled it in. */
+BZ_DEFINE_DATA (
+    corpus,
+    Corpus,
+    {
+      GPtrArray   *groups;
+      GArray      *searchable;
+      GHashTable  *id_to_idx;
+      StringColumn ids;
+      StringColumn titles;
+      TokenColumn  fields[N_FIELDS];
+    },
+    corpus_clear (self);)
+static DexFuture *
+build_corpus_fiber (CorpusData *data);
+
+/* The entries a query matched at all, before the threshold and biases
+ * were applied, with its lowercased tokens. A later query whose tokens
+ * each contain the token at the same position can only match a subset. */
+BZ_DEFINE_DATA (
+    last_match,
+    LastMatch,
+    {
+      CorpusData *corpus;
+      char      **tokens;
+      GArray     *matched;
+    },
+    BZ_RELEASE_DATA (corpus, corpus_data_unref);
+    BZ_RELEASE_DATA (tokens, g_strfreev);
+    BZ_RELEASE_DATA (matched, g_array_unref))
+
+/* Shared between the engine and the queries it has spawned, which may
+ * still be running after it is gone */
+BZ_DEFINE_DATA (
+    query_state,
+    QueryState,
+    {
+      GMutex         mutex;
+      LastMatchData *last;
+    },
+    g_mutex_clear (&self->mutex);
+    BZ_RELEASE_DATA (last, last_match_data_unref))
+
+/* Which of `biases` boost which entries of `corpus`, worked out whenever
+ * either changes so queries only have to test a bit: bit `j` of the
+ * `n_words` words at `bits + i * n_words` is set when `biases[j]` boosts
+ * entry `i`. */
+BZ_DEFINE_DATA (
+    boosts,
+    Boosts,
+    {
+      CorpusData *corpus;
+      DexFuture  *corpus_ready;
+      GPtrArray  *biases;
+      guint       n_words;
+      guint64    *bits;
+    },
+    BZ_RELEASE_DATA (corpus, corpus_data_unref);
+    BZ_RELEASE_DATA (corpus_ready, dex_unref);
+    BZ_RELEASE_DATA (biases, g_ptr_array_unref);
+    BZ_RELEASE_DATA (bits, g_free))
+static DexFuture *
+build_boosts_fiber (BoostsData *data);
+
+#define BOOSTS_TEST(_boosts, _idx, _bit)                                   \
+  (((_boosts)->bits[(gsize) (_idx) * (_boosts)->n_words + (_bit) / 64] >> \
+    ((_bit) % 64)) &                                                       \
+   1)
+
+/* Every distinct token indexed so far, with `ids` mapping each to its
+ * position in `tokens`. Successive indexes share one dictionary so a
+ * rebuild only looks up tokens of entries that changed. Strings are never
+ * removed and never move, so an older index can keep using them while a
+ * newer one adds more; only one build touches the dictionary at a time. */
+BZ_DEFINE_DATA (
+    token_dictionary,
+    TokenDictionary,
+    {
+      GStringChunk *strings;
+      GHashTable   *ids;
+      GPtrArray    *tokens;
+    },
+    BZ_RELEASE_DATA (ids, g_hash_table_unref);
+    BZ_RELEASE_DATA (tokens, g_ptr_array_unref);
+    BZ_RELEASE_DATA (strings, g_string_chunk_free))
+
+/* A suffix of dictionary token `token`, starting `offset` bytes in */
+typedef struct
+{
+  guint32 token;
+  guint32 offset;
+} Suffix;
+
+/* An inverted index over `corpus`. A query token occurs inside a corpus
+ * token exactly when it is a prefix of one of its suffixes, so `suffixes`
+ * holds every suffix of every token, sorted. For token `t`, the entries it
+ * occurs in are `postings[posting_starts[t]]` up to
+ * `postings[posting_starts[t + 1]]`. Entry `i` has the token ids
+ * `entry_tokens[entry_starts[i]]` up to `entry_tokens[entry_starts[i + 1]]`,
+ * which the next build reuses for entries that did not change. Only read
+ * once `ready` is set. */
+BZ_DEFINE_DATA (
+    token_index,
+    TokenIndex,
+    {
+      CorpusData          *corpus;
+      TokenDictionaryData *dictionary;
+      const char         **tokens;
+      guint                n_tokens;
+      guint                n_live;
+      GArray              *suffixes;
+      guint32             *posting_starts;
+      guint32             *postings;
+      GArray              *entry_starts;
+      GArray              *entry_tokens;
+      gint                 ready;
+    },
+    BZ_RELEASE_DATA (corpus, corpus_data_unref);
+    BZ_RELEASE_DATA (dictionary, token_dictionary_data_unref);
+    BZ_RELEASE_DATA (tokens, g_free);
+    BZ_RELEASE_DATA (suffixes, g_array_unref);
+    BZ_RELEASE_DATA (posting_starts, g_free);
+    BZ_RELEASE_DATA (postings, g_free);
+    BZ_RELEASE_DATA (entry_starts, g_array_unref);
+    BZ_RELEASE_DATA (entry_tokens, g_array_unref))
+
+/* Builds are chained, each waiting on the one before it so they take turns
+ * with the shared dictionary */
+BZ_DEFINE_DATA (
+    build_index,
+    BuildIndex,
+    {
+      TokenIndexData *index;
+      DexFuture      *corpus_ready;
+      TokenIndexData *previous;
+      DexFuture      *previous_ready;
+    },
+    BZ_RELEASE_DATA (index, token_index_data_unref);
+    BZ_RELEASE_DATA (corpus_ready, dex_unref);
+    BZ_RELEASE_DATA (previous, token_index_data_unref);
+    BZ_RELEASE_DATA (previous_ready, dex_unref))
+static DexFuture *
+build_index_fiber (BuildIndexData *data);
+
+/* The ranked results for every token of up to PREFIX_TABLE_MAX_CHARS
+ * characters that at least PREFIX_TABLE_MIN_MATCHES entries of
+ * `index->corpus` have, as it would score on its own without biases.
+ * `lists` maps the token to every entry it matched, best first. Only read
+ * once `ready` is set. A build gives up as soon as `superseded` is set. */
+BZ_DEFINE_DATA (
+    prefix_table,
+    PrefixTable,
+    {
+      TokenIndexData *index;
+      DexFuture      *index_ready;
+      GHashTable     *lists;
+      gint            ready;
+      gint            superseded;
+    },
+    BZ_RELEASE_DATA (index, token_index_data_unref);
+    BZ_RELEASE_DATA (index_ready, dex_unref);
+    BZ_RELEASE_DATA (lists, g_hash_table_unref))
+static DexFuture *
+build_prefix_table_fiber (PrefixTableData *data);
+
 struct _BzSearchEngine
 {
   GObject parent_instance;
@@ -35,6 +308,32 @@ struct _BzSearchEngine
   GListModel *biases;
 
   GPtrArray *biases_mirror;
+
+  /* the model's items, kept in step with items-changed so a rebuild of the
+     corpus does not have to walk the whole model again. Groups can also
+     change in place without the model saying so, so each one's fields the
+     corpus copies are watched too. */
+  GPtrArray  *groups;
+  CorpusData *corpus;
+  DexFuture  *corpus_future;
+  guint       corpus_rebuild;
+
+  BoostsData *boosts;
+  DexFuture  *boosts_future;
+
+  /* rebuilt along with the corpus, from the previous one */
+  TokenIndexData *index;
+  DexFuture      *index_future;
+
+  PrefixTableData *prefixes;
+  DexFuture       *prefixes_future;
+
+  QueryStateData *state;
+
+  gboolean fuzzy;
+
+  /* the last RECENT_QUERIES that went through, oldest first */
+  GListStore *recent_queries;
 };
 
 G_DEFINE_FINAL_TYPE (BzSearchEngine, bz_search_engine, G_TYPE_OBJECT);
@@ -45,6 +344,8 @@ enum
 
   PROP_MODEL,
   PROP_BIASES,
+  PROP_FUZZY,
+  PROP_RECENT_QUERIES,
 
   LAST_PROP
 };
@@ -57,15 +358,103 @@ biases_changed (BzSearchEngine *self,
                 guint           added,
                 GListModel     *model);
 
+static void
+model_changed (BzSearchEngine *self,
+               guint           position,
+               guint           removed,
+               guint           added,
+               GListModel     *model);
+
+static void
+rebuild_corpus (BzSearchEngine *self);
+
+static void
+group_changed (BzSearchEngine *self,
+               GParamSpec     *pspec,
+               BzEntryGroup   *group);
+
+static void
+schedule_rebuild_corpus (BzSearchEngine *self);
+
+static void
+rebuild_boosts (BzSearchEngine *self);
+
+static void
+rebuild_index (BzSearchEngine *self);
+
+static void
+rebuild_prefix_table (BzSearchEngine *self);
+
+static void
+splice_groups (BzSearchEngine *self,
+               guint           position,
+               guint           removed,
+               guint           added);
+
+/* A query token prepared for Myers' bit-parallel edit distance: bit `i`
+ * of `peq[c]` is set when byte `i` of the token is `c`. A `max_distance`
+ * of 0 means the token has to match exactly. */
+typedef struct
+{
+  guint64 peq[256];
+  guint   length;
+  guint   max_distance;
+} FuzzyPattern;
+
+static FuzzyPattern *
+build_fuzzy_patterns (const TokenColumn *query);
+
+static gboolean
+test_token_fuzzy (const FuzzyPattern *pattern,
+                  guint32             pattern_chars,
+                  const char         *run,
+                  const char         *run_end,
+                  const guint32      *chars,
+                  gssize              accept_min_size,
+                  double             *score);
+
 static double
-test_strings (const char *query,
-              const char *against,
-              gssize      accept_min_size);
+test_strings (const TokenColumn  *query,
+              const FuzzyPattern *patterns,
+              const TokenColumn  *against,
+              guint               against_idx,
+              gssize              accept_min_size);
+
+/* Returns where `needle` first occurs in the `haystack_len` bytes at
+ * `haystack`, neither of which has to be NUL terminated */
+typedef const char *(*FindFunc) (const char *haystack,
+                                 gsize       haystack_len,
+                                 const char *needle,
+                                 gsize       needle_len);
+
+/* picked in class_init () according to what the CPU supports */
+static FindFunc find_bytes = NULL;
+
+static const char *
+find_bytes_scalar (const char *haystack,
+                   gsize       haystack_len,
+                   const char *needle,
+                   gsize       needle_len);
+
+#ifdef HAVE_X86_FIND_KERNELS
+static const char *
+find_bytes_sse2 (const char *haystack,
+                 gsize       haystack_len,
+                 const char *needle,
+                 gsize       needle_len);
+
+static const char *
+find_bytes_avx2 (const char *haystack,
+                 gsize       haystack_len,
+                 const char *needle,
+                 gsize       needle_len);
+#endif
 
 typedef struct
 {
-  guint  idx;
-  double val;
+  guint    idx;
+  double   val;
+  gboolean matched;
 } Score;
 
 static gint
@@ -109,47 +498,181 @@ BZ_DEFINE_DATA (
     query_task,
     QueryTask,
     {
-      char     **terms;
-      GPtrArray *snapshot;
-      GPtrArray *biases;
+      char                 **terms;
+      CorpusData            *corpus;
+      GPtrArray             *biases;
+      BoostsData            *boosts;
+      DexFuture             *boosts_ready;
+      TokenIndexData        *index;
+      PrefixTableData       *prefixes;
+      QueryStateData        *state;
+      GCancellable          *cancellable;
+      gboolean               fuzzy;
+      GListStore            *recent_queries;
+      DexPromise            *head;
+      BzSearchResults       *results;
+      guint                  tail_position;
+      GArray                *tail_indices;
+      GArray                *tail_values;
+      double                 tail_sort_elapsed;
+      BzFinishedSearchQuery *finished;
     },
     BZ_RELEASE_DATA (terms, g_strfreev);
-    BZ_RELEASE_DATA (snapshot, g_ptr_array_unref);
-    BZ_RELEASE_DATA (biases, g_ptr_array_unref))
+    BZ_RELEASE_DATA (corpus, corpus_data_unref);
+    BZ_RELEASE_DATA (biases, g_ptr_array_unref);
+    BZ_RELEASE_DATA (boosts, boosts_data_unref);
+    BZ_RELEASE_DATA (boosts_ready, dex_unref);
+    BZ_RELEASE_DATA (index, token_index_data_unref);
+    BZ_RELEASE_DATA (prefixes, prefix_table_data_unref);
+    BZ_RELEASE_DATA (state, query_state_data_unref);
+    BZ_RELEASE_DATA (cancellable, g_object_unref);
+    BZ_RELEASE_DATA (recent_queries, g_object_unref);
+    BZ_RELEASE_DATA (head, dex_unref);
+    BZ_RELEASE_DATA (results, g_object_unref);
+    BZ_RELEASE_DATA (tail_indices, g_array_unref);
+    BZ_RELEASE_DATA (tail_values, g_array_unref);
+    BZ_RELEASE_DATA (finished, g_object_unref))
 static DexFuture *
 query_task_fiber (QueryTaskData *data);
+static DexFuture *
+query_tail_then (DexFuture     *future,
+                 QueryTaskData *data);
+static DexFuture *
+query_task_catch (DexFuture     *future,
+                  QueryTaskData *data);
+
+/* The entries a query scores, either every one in the corpus or just
+ * `candidates`. Sub tasks claim chunks of them by advancing `cursor`, so a
+ * worker that happens to get cheap entries simply takes more of them. */
+BZ_DEFINE_DATA (
+    work,
+    Work,
+    {
+      GArray *candidates;
+      guint   length;
+      gint    cursor;
+    },
+    BZ_RELEASE_DATA (candidates, g_array_unref))
 
 BZ_DEFINE_DATA (
     query_sub_task,
     QuerySubTask,
     {
-      char      *query_utf8;
-      GPtrArray *shallow_mirror;
-      double     threshold;
-      guint      work_offset;
-      guint      work_length;
-      GPtrArray *active_biases;
+      char         *query_utf8;
+      CorpusData   *corpus;
+      WorkData     *work;
+      double        threshold;
+      GPtrArray    *active_biases;
+      GArray       *active_bits;
+      BoostsData   *boosts;
+      gboolean      fuzzy;
+      GCancellable *cancellable;
     },
     BZ_RELEASE_DATA (query_utf8, g_free);
-    BZ_RELEASE_DATA (shallow_mirror, g_ptr_array_unref);
-    BZ_RELEASE_DATA (active_biases, g_ptr_array_unref));
+    BZ_RELEASE_DATA (corpus, corpus_data_unref);
+    BZ_RELEASE_DATA (work, work_data_unref);
+    BZ_RELEASE_DATA (active_biases, g_ptr_array_unref);
+    BZ_RELEASE_DATA (active_bits, g_array_unref);
+    BZ_RELEASE_DATA (boosts, boosts_data_unref);
+    BZ_RELEASE_DATA (cancellable, g_object_unref));
 static DexFuture *
 query_sub_task_fiber (QuerySubTaskData *data);
 
-static inline GUnicodeType
-utf8_char_class (const char *s,
-                 gunichar   *ch_out);
+static double
+score_entry (CorpusData         *corpus,
+             const TokenColumn  *query,
+             const FuzzyPattern *patterns,
+             const char         *query_utf8,
+             GPtrArray          *active_biases,
+             GArray             *active_bits,
+             BoostsData         *boosts,
+             guint               idx,
+             gboolean           *matched_out);
+
+static GPtrArray *
+score_work (QueryTaskData *data,
+            const char    *query_utf8,
+            WorkData      *work,
+            double         threshold,
+            GPtrArray     *active_biases,
+            GArray        *active_bits,
+            gboolean       fuzzy,
+            GError       **error);
 
-static inline const char *
-utf8_skip_to_next_of_class (const char **s,
-                            GUnicodeType class,
-                            gsize       *read_utf8);
+static void
+select_top (GArray *scores,
+            guint   n);
+
+static GArray *
+merge_sorted_runs (GPtrArray *runs,
+                   guint     *heads,
+                   double     threshold,
+                   guint      limit);
+
+static GArray *
+collect_tail (GPtrArray   *runs,
+              const guint *heads,
+              double       threshold);
+
+static inline gboolean
+query_superseded (GCancellable *cancellable);
+
+static inline DexFuture *
+new_superseded_error (void);
+
+static char **
+tokenize_query (const char *query);
+
+static gboolean
+query_refines (char **previous,
+               char **tokens);
+
+static gboolean
+query_allows_typos (char **tokens);
+
+static GArray *
+collect_unscored (CorpusData *corpus,
+                  GPtrArray  *runs);
+
+static GArray *
+lookup_token_index (TokenIndexData *index,
+                    char          **tokens);
+
+static GArray *
+lookup_prefix_table (PrefixTableData *prefixes,
+                     CorpusData      *corpus,
+                     const char      *query_utf8,
+                     char           **tokens,
+                     GPtrArray       *active_biases);
+
+static gboolean
+same_entry_text (CorpusData *a,
+                 guint       a_idx,
+                 CorpusData *b,
+                 guint       b_idx);
+
+static gint
+cmp_suffixes (const Suffix *a,
+              const Suffix *b,
+              const char  **tokens);
+
+static GArray *
+collect_candidates (CorpusData *corpus,
+                    GArray     *seed,
+                    const char *query_utf8,
+                    GPtrArray  *active_biases);
+
+static gint
+cmp_guint (gconstpointer a,
+           gconstpointer b);
 
 static void
 bz_search_engine_dispose (GObject *object)
 {
   BzSearchEngine *self = BZ_SEARCH_ENGINE (object);
 
+  if (self->model != NULL)
+    g_signal_handlers_disconnect_by_func (self->model, model_changed, self);
   if (self->biases != NULL)
     g_signal_handlers_disconnect_by_func (self->biases, biases_changed, self);
 
@@ -158,6 +681,25 @@ bz_search_engine_dispose (GObject *object)
 
   g_clear_pointer (&self->biases_mirror, g_ptr_array_unref);
 
+  g_clear_handle_id (&self->corpus_rebuild, g_source_remove);
+  if (self->groups != NULL)
+    splice_groups (self, 0, self->groups->len, 0);
+  g_clear_pointer (&self->groups, g_ptr_array_unref);
+  g_clear_pointer (&self->corpus, corpus_data_unref);
+  dex_clear (&self->corpus_future);
+  g_clear_pointer (&self->boosts, boosts_data_unref);
+  dex_clear (&self->boosts_future);
+  g_clear_pointer (&self->index, token_index_data_unref);
+  dex_clear (&self->index_future);
+  if (self->prefixes != NULL)
+    g_atomic_int_set (&self->prefixes->superseded, TRUE);
+  g_clear_pointer (&self->prefixes, prefix_table_data_unref);
+  dex_clear (&self->prefixes_future);
+
+  g_clear_pointer (&self->state, query_state_data_unref);
+
+  g_clear_object (&self->recent_queries);
+
   G_OBJECT_CLASS (bz_search_engine_parent_class)->dispose (object);
 }
 
@@ -177,6 +719,12 @@ bz_search_engine_get_property (GObject    *object,
     case PROP_BIASES:
       g_value_set_object (value, bz_search_engine_get_biases (self));
       break;
+    case PROP_FUZZY:
+      g_value_set_boolean (value, bz_search_engine_get_fuzzy (self));
+      break;
+    case PROP_RECENT_QUERIES:
+      g_value_set_object (value, bz_search_engine_get_recent_queries (self));
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
     }
@@ -198,6 +746,10 @@ bz_search_engine_set_property (GObject      *object,
     case PROP_BIASES:
       bz_search_engine_set_biases (self, g_value_get_object (value));
       break;
+    case PROP_FUZZY:
+      bz_search_engine_set_fuzzy (self, g_value_get_boolean (value));
+      break;
+    case PROP_RECENT_QUERIES:
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
     }
@@ -226,13 +778,43 @@ bz_search_engine_class_init (BzSearchEngineClass *klass)
           G_TYPE_LIST_MODEL,
           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_EXPLICIT_NOTIFY);
 
+  props[PROP_FUZZY] =
+      g_param_spec_boolean (
+          "fuzzy",
+          NULL, NULL, FALSE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_EXPLICIT_NOTIFY);
+
+  props[PROP_RECENT_QUERIES] =
+      g_param_spec_object (
+          "recent-queries",
+          NULL, NULL,
+          G_TYPE_LIST_MODEL,
+          G_PARAM_READABLE | G_PARAM_STATIC_STRINGS);
+
   g_object_class_install_properties (object_class, LAST_PROP, props);
+
+  find_bytes = find_bytes_scalar;
+#ifdef HAVE_X86_FIND_KERNELS
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("avx2"))
+    find_bytes = find_bytes_avx2;
+  else if (__builtin_cpu_supports ("sse2"))
+    find_bytes = find_bytes_sse2;
+#endif
 }
 
 static void
 bz_search_engine_init (BzSearchEngine *self)
 {
   self->biases_mirror = g_ptr_array_new_with_free_func (bias_data_unref);
+
+  self->state = query_state_data_new ();
+  g_mutex_init (&self->state->mutex);
+
+  self->groups = g_ptr_array_new_with_free_func (g_object_unref);
+  rebuild_corpus (self);
+
+  self->recent_queries = g_list_store_new (BZ_TYPE_FINISHED_SEARCH_QUERY);
 }
 
 BzSearchEngine *
@@ -258,7 +840,10 @@ bz_search_engine_set_biases (BzSearchEngine *self,
   if (self->biases != NULL)
     g_signal_handlers_disconnect_by_func (self->biases, biases_changed, self);
   g_clear_object (&self->biases);
-  g_ptr_array_set_size (self->biases_mirror, 0);
+
+  /* other threads may still hold the old mirror */
+  g_clear_pointer (&self->biases_mirror, g_ptr_array_unref);
+  self->biases_mirror = g_ptr_array_new_with_free_func (bias_data_unref);
 
   if (biases != NULL)
     {
@@ -273,6 +858,8 @@ bz_search_engine_set_biases (BzSearchEngine *self,
           biases, "items-changed",
           G_CALLBACK (biases_changed), self);
     }
+  else
+    rebuild_boosts (self);
 
   g_object_notify_by_pspec (G_OBJECT (self), props[PROP_BIASES]);
 }
@@ -291,77 +878,131 @@ bz_search_engine_set_model (BzSearchEngine *self,
   g_return_if_fail (BZ_IS_SEARCH_ENGINE (self));
   g_return_if_fail (model == NULL || G_IS_LIST_MODEL (model));
 
+  if (self->model != NULL)
+    g_signal_handlers_disconnect_by_func (self->model, model_changed, self);
   g_clear_object (&self->model);
+
   if (model != NULL)
-    self->model = g_object_ref (model);
+    {
+      self->model = g_object_ref (model);
+      g_signal_connect_swapped (
+          model, "items-changed",
+          G_CALLBACK (model_changed), self);
+    }
+
+  splice_groups (
+      self, 0, self->groups->len,
+      model != NULL ? g_list_model_get_n_items (model) : 0);
+
+  g_clear_handle_id (&self->corpus_rebuild, g_source_remove);
+  rebuild_corpus (self);
 
   g_object_notify_by_pspec (G_OBJECT (self), props[PROP_MODEL]);
 }
 
+gboolean
+bz_search_engine_get_fuzzy (BzSearchEngine *self)
+{
+  g_return_val_if_fail (BZ_IS_SEARCH_ENGINE (self), FALSE);
+  return self->fuzzy;
+}
+
+/* Whether queries that find next to nothing are tried again allowing a
+ * typo or two in each longer word */
+void
+bz_search_engine_set_fuzzy (BzSearchEngine *self,
+                            gboolean        fuzzy)
+{
+  g_return_if_fail (BZ_IS_SEARCH_ENGINE (self));
+
+  fuzzy = !!fuzzy;
+  if (fuzzy == self->fuzzy)
+    return;
+
+  self->fuzzy = fuzzy;
+  g_object_notify_by_pspec (G_OBJECT (self), props[PROP_FUZZY]);
+}
+
+/* The BzFinishedSearchQuery of each of the last few queries that ran to
+ * completion, oldest first, with the time each phase took */
+GListModel *
+bz_search_engine_get_recent_queries (BzSearchEngine *self)
+{
+  g_return_val_if_fail (BZ_IS_SEARCH_ENGINE (self), NULL);
+  return G_LIST_MODEL (self->recent_queries);
+}
+
 DexFuture *
 bz_search_engine_query (BzSearchEngine    *self,
                         const char *const *terms)
 {
-  guint n_groups = 0;
+  GPtrArray *groups = NULL;
 
   dex_return_error_if_fail (BZ_IS_SEARCH_ENGINE (self));
   dex_return_error_if_fail (terms != NULL && *terms != NULL);
 
-  if (self->model != NULL)
-    n_groups = g_list_model_get_n_items (self->model);
+  /* a query must never see an older model than the caller does */
+  if (self->corpus_rebuild > 0)
+    {
+      g_clear_handle_id (&self->corpus_rebuild, g_source_remove);
+      rebuild_corpus (self);
+    }
+  groups = self->corpus->groups;
 
-  if (self->model == NULL ||
-      n_groups == 0 ||
+  if (groups->len == 0 ||
       **terms == '\0')
     {
-      g_autoptr (GPtrArray) results              = NULL;
+      g_autoptr (BzSearchResults) results        = NULL;
       g_autoptr (BzFinishedSearchQuery) finished = NULL;
 
-      results = g_ptr_array_new_with_free_func (g_object_unref);
-      g_ptr_array_set_size (results, n_groups);
-
-      for (guint i = 0; i < results->len; i++)
-        {
-          g_autoptr (BzEntryGroup) group    = NULL;
-          g_autoptr (BzSearchResult) result = NULL;
-
-          group = g_list_model_get_item (self->model, i);
-
-          result = bz_search_result_new ();
-          bz_search_result_set_group (result, group);
-          bz_search_result_set_original_index (result, i);
-          g_ptr_array_index (results, i) = g_steal_pointer (&result);
-        }
+      results = bz_search_results_new (groups, NULL, NULL);
 
       finished = bz_finished_search_query_new ();
       bz_finished_search_query_set_interpreted_query (finished, "");
-      bz_finished_search_query_set_results (finished, results);
-      bz_finished_search_query_set_n_results (finished, n_groups);
+      bz_finished_search_query_set_results (finished, G_LIST_MODEL (results));
+      bz_finished_search_query_set_n_results (finished, groups->len);
       bz_finished_search_query_set_elapsed (finished, 0.0);
 
       return dex_future_new_for_object (finished);
     }
   else
     {
-      g_autoptr (GPtrArray) snapshot = NULL;
       g_autoptr (QueryTaskData) data = NULL;
-
-      snapshot = g_ptr_array_new_with_free_func (g_object_unref);
-      g_ptr_array_set_size (snapshot, n_groups);
-
-      for (guint i = 0; i < snapshot->len; i++)
-        g_ptr_array_index (snapshot, i) = g_list_model_get_item (self->model, i);
-
-      data           = query_task_data_new ();
-      data->terms    = g_strdupv ((gchar **) terms);
-      data->snapshot = g_steal_pointer (&snapshot);
-      data->biases   = g_ptr_array_ref (self->biases_mirror);
-
-      return dex_scheduler_spawn (
+      g_autoptr (DexFuture) future   = NULL;
+
+      data               = query_task_data_new ();
+      data->terms        = g_strdupv ((gchar **) terms);
+      data->corpus       = corpus_data_ref (self->boosts->corpus);
+      data->biases       = g_ptr_array_ref (self->boosts->biases);
+      data->boosts       = boosts_data_ref (self->boosts);
+      data->boosts_ready = dex_ref (self->boosts_future);
+      data->index        = token_index_data_ref (self->index);
+      data->prefixes     = prefix_table_data_ref (self->prefixes);
+      data->state        = query_state_data_ref (self->state);
+      data->fuzzy        = self->fuzzy;
+      data->head         = dex_promise_new_cancellable ();
+      data->cancellable  = g_object_ref (dex_promise_get_cancellable (data->head));
+
+      data->recent_queries = g_object_ref (self->recent_queries);
+
+      /* The caller gets `head` as soon as the best results are ranked, and
+         the results it holds are reordered once the rest are. Once it drops
+         `head` the query is cancelled, and the work it still has in flight
+         notices and bails. */
+      future = dex_scheduler_spawn (
           dex_thread_pool_scheduler_get_default (),
           bz_get_dex_stack_size (),
           (DexFiberFunc) query_task_fiber,
           query_task_data_ref (data), query_task_data_unref);
+      future = dex_future_then (
+          future, (DexFutureCallback) query_tail_then,
+          query_task_data_ref (data), query_task_data_unref);
+      future = dex_future_catch (
+          future, (DexFutureCallback) query_task_catch,
+          query_task_data_ref (data), query_task_data_unref);
+      dex_future_disown (g_steal_pointer (&future));
+
+      return dex_ref (DEX_FUTURE (data->head));
     }
 }
 
@@ -509,374 +1150,2040 @@ biases_changed (BzSearchEngine *self,
 
   g_clear_pointer (&self->biases_mirror, g_ptr_array_unref);
   self->biases_mirror = g_steal_pointer (&new_mirror);
+
+  rebuild_boosts (self);
 }
 
-static DexFuture *
-query_task_fiber (QueryTaskData *data)
+static void
+model_changed (BzSearchEngine *self,
+               guint           position,
+               guint           removed,
+               guint           added,
+               GListModel     *model)
 {
-  char     **terms                           = data->terms;
-  GPtrArray *shallow_mirror                  = data->snapshot;
-  GPtrArray *biases                          = data->biases;
-  g_autoptr (GError) local_error             = NULL;
-  gboolean result                            = FALSE;
-  g_autoptr (GTimer) timer                   = NULL;
-  g_autofree char *query_utf8                = NULL;
-  guint            n_sub_tasks               = 0;
-  guint            scores_per_task           = 0;
-  g_autoptr (GPtrArray) active_biases        = NULL;
-  g_autoptr (GPtrArray) sub_futures          = NULL;
-  g_autoptr (GArray) scores                  = NULL;
-  g_autoptr (GPtrArray) results              = NULL;
-  g_autoptr (BzFinishedSearchQuery) finished = NULL;
-
-  timer = g_timer_new ();
+  splice_groups (self, position, removed, added);
+  schedule_rebuild_corpus (self);
+}
 
-  query_utf8      = g_strjoinv (" ", terms);
-  n_sub_tasks     = MAX (1, MIN (shallow_mirror->len / 512, g_get_num_processors ()));
-  scores_per_task = shallow_mirror->len / n_sub_tasks;
+static void
+group_changed (BzSearchEngine *self,
+               GParamSpec     *pspec,
+               BzEntryGroup   *group)
+{
+  schedule_rebuild_corpus (self);
+}
 
-  active_biases = g_ptr_array_new_with_free_func (bias_data_unref);
-  for (guint i = 0; i < biases->len; i++)
-    {
-      BiasData *bias = NULL;
+static void
+schedule_rebuild_corpus (BzSearchEngine *self)
+{
+  /* filter models report changes in bursts and groups are filled in a
+     field at a time, only rebuild once they settle */
+  if (self->corpus_rebuild == 0)
+    self->corpus_rebuild = g_idle_add_once ((GSourceOnceFunc) rebuild_corpus, self);
+}
 
-      bias = g_ptr_array_index (biases, i);
-      if (bias->invalid)
-        continue;
+static void
+rebuild_corpus (BzSearchEngine *self)
+{
+  g_autoptr (CorpusData) corpus = NULL;
 
-      if (!g_regex_match (bias->regex, query_utf8, G_REGEX_MATCH_DEFAULT, NULL))
-        continue;
+  self->corpus_rebuild = 0;
 
-      if (bias->convert_to != NULL)
-        {
-          g_autofree char *tmp = NULL;
+  g_clear_pointer (&self->corpus, corpus_data_unref);
+  dex_clear (&self->corpus_future);
 
-          tmp = g_regex_replace (
-              bias->regex, query_utf8,
-              -1, 0, bias->convert_to,
-              G_REGEX_MATCH_DEFAULT, NULL);
-          if (tmp != NULL)
-            {
-              g_clear_pointer (&query_utf8, g_free);
-              query_utf8 = g_steal_pointer (&tmp);
-            }
-        }
+  /* the corpus is read from other threads, so it gets its own copy */
+  corpus         = corpus_data_new ();
+  corpus->groups = g_ptr_array_copy (self->groups, (GCopyFunc) g_object_ref, NULL);
+  g_ptr_array_set_free_func (corpus->groups, g_object_unref);
 
-      g_ptr_array_add (active_biases, bias_data_ref (bias));
-    }
+  self->corpus        = corpus_data_ref (corpus);
+  self->corpus_future = dex_scheduler_spawn (
+      dex_thread_pool_scheduler_get_default (),
+      bz_get_dex_stack_size (),
+      (DexFiberFunc) build_corpus_fiber,
+      corpus_data_ref (corpus), corpus_data_unref);
 
-  sub_futures = g_ptr_array_new_with_free_func (dex_unref);
-  for (guint i = 0; i < n_sub_tasks; i++)
-    {
-      g_autoptr (QuerySubTaskData) sub_data = NULL;
-      g_autoptr (DexFuture) future          = NULL;
+  rebuild_boosts (self);
+  rebuild_index (self);
+  rebuild_prefix_table (self);
+}
 
-      sub_data                 = query_sub_task_data_new ();
-      sub_data->query_utf8     = g_strdup (query_utf8);
-      sub_data->shallow_mirror = g_ptr_array_ref (shallow_mirror);
-      sub_data->threshold      = 1.0;
-      sub_data->work_offset    = i * scores_per_task;
-      sub_data->work_length    = scores_per_task;
-      sub_data->active_biases  = g_ptr_array_ref (active_biases);
+static void
+rebuild_boosts (BzSearchEngine *self)
+{
+  g_autoptr (BoostsData) boosts = NULL;
+
+  g_clear_pointer (&self->boosts, boosts_data_unref);
+  dex_clear (&self->boosts_future);
+
+  boosts               = boosts_data_new ();
+  boosts->corpus       = corpus_data_ref (self->corpus);
+  boosts->corpus_ready = dex_ref (self->corpus_future);
+  boosts->biases       = g_ptr_array_ref (self->biases_mirror);
+
+  self->boosts        = boosts_data_ref (boosts);
+  self->boosts_future = dex_scheduler_spawn (
+      dex_thread_pool_scheduler_get_default (),
+      bz_get_dex_stack_size (),
+      (DexFiberFunc) build_boosts_fiber,
+      boosts_data_ref (boosts), boosts_data_unref);
+}
 
-      if (i >= n_sub_tasks - 1)
-        sub_data->work_length += shallow_mirror->len % n_sub_tasks;
+static void
+rebuild_index (BzSearchEngine *self)
+{
+  g_autoptr (TokenIndexData) index = NULL;
+  g_autoptr (BuildIndexData) data  = NULL;
 
-      future = dex_scheduler_spawn (
-          dex_thread_pool_scheduler_get_default (),
-          bz_get_dex_stack_size (),
-          (DexFiberFunc) query_sub_task_fiber,
-          query_sub_task_data_ref (sub_data),
-          query_sub_task_data_unref);
+  index         = token_index_data_new ();
+  index->corpus = corpus_data_ref (self->corpus);
 
-      g_ptr_array_add (sub_futures, g_steal_pointer (&future));
+  data               = build_index_data_new ();
+  data->index        = token_index_data_ref (index);
+  data->corpus_ready = dex_ref (self->corpus_future);
+  if (self->index != NULL)
+    {
+      data->previous       = g_steal_pointer (&self->index);
+      data->previous_ready = g_steal_pointer (&self->index_future);
     }
 
-  result = dex_await (dex_future_allv (
-                          (DexFuture *const *) sub_futures->pdata, sub_futures->len),
-                      &local_error);
-  if (!result)
-    return dex_future_new_for_error (g_steal_pointer (&local_error));
+  self->index        = token_index_data_ref (index);
+  self->index_future = dex_scheduler_spawn (
+      dex_thread_pool_scheduler_get_default (),
+      bz_get_dex_stack_size (),
+      (DexFiberFunc) build_index_fiber,
+      build_index_data_ref (data), build_index_data_unref);
+}
 
-  scores = g_array_new (FALSE, FALSE, sizeof (Score));
-  for (guint i = 0; i < sub_futures->len; i++)
-    {
-      DexFuture *future     = NULL;
-      GArray    *scores_out = NULL;
+static void
+rebuild_prefix_table (BzSearchEngine *self)
+{
+  g_autoptr (PrefixTableData) prefixes = NULL;
+
+  /* the fiber may be past its await already, where dropping the future
+     won't stop it */
+  if (self->prefixes != NULL)
+    g_atomic_int_set (&self->prefixes->superseded, TRUE);
+  g_clear_pointer (&self->prefixes, prefix_table_data_unref);
+  dex_clear (&self->prefixes_future);
+
+  prefixes              = prefix_table_data_new ();
+  prefixes->index       = token_index_data_ref (self->index);
+  prefixes->index_ready = dex_ref (self->index_future);
+
+  self->prefixes        = prefix_table_data_ref (prefixes);
+  self->prefixes_future = dex_scheduler_spawn (
+      dex_thread_pool_scheduler_get_default (),
+      bz_get_dex_stack_size (),
+      (DexFiberFunc) build_prefix_table_fiber,
+      prefix_table_data_ref (prefixes), prefix_table_data_unref);
+}
 
-      future     = g_ptr_array_index (sub_futures, i);
-      scores_out = g_value_get_boxed (dex_future_get_value (future, NULL));
+static void
+splice_groups (BzSearchEngine *self,
+               guint           position,
+               guint           removed,
+               guint           added)
+{
+  guint old_len = 0;
 
-      if (scores_out->len > 0)
-        g_array_append_vals (scores, scores_out->data, scores_out->len);
+  for (guint i = 0; i < removed; i++)
+    g_signal_handlers_disconnect_by_func (
+        g_ptr_array_index (self->groups, position + i), group_changed, self);
+
+  old_len = self->groups->len;
+  g_ptr_array_remove_range (self->groups, position, removed);
+  g_ptr_array_set_size (self->groups, old_len - removed + added);
+
+  if (old_len - removed > position)
+    memmove (self->groups->pdata + position + added,
+             self->groups->pdata + position,
+             (old_len - removed - position) * sizeof (gpointer));
+  for (guint i = 0; i < added; i++)
+    {
+      BzEntryGroup *group = NULL;
+
+      /* everything build_corpus_fiber () reads */
+      group = g_list_model_get_item (self->model, position + i);
+      g_signal_connect_swapped (group, "notify::id", G_CALLBACK (group_changed), self);
+      g_signal_connect_swapped (group, "notify::title", G_CALLBACK (group_changed), self);
+      g_signal_connect_swapped (group, "notify::developer", G_CALLBACK (group_changed), self);
+      g_signal_connect_swapped (group, "notify::description", G_CALLBACK (group_changed), self);
+      g_signal_connect_swapped (group, "notify::search-tokens", G_CALLBACK (group_changed), self);
+      g_signal_connect_swapped (group, "notify::searchable", G_CALLBACK (group_changed), self);
+      g_ptr_array_index (self->groups, position + i) = group;
+    }
+}
+
+static DexFuture *
+build_corpus_fiber (CorpusData *data)
+{
+  data->searchable = g_array_sized_new (FALSE, TRUE, sizeof (gboolean), data->groups->len);
+  data->id_to_idx  = g_hash_table_new (g_str_hash, g_str_equal);
+  string_column_init (&data->ids);
+  string_column_init (&data->titles);
+  for (guint i = 0; i < N_FIELDS; i++)
+    token_column_init (&data->fields[i]);
+
+  for (guint i = 0; i < data->groups->len; i++)
+    {
+      g_autoptr (GMutexLocker) locker = NULL;
+      BzEntryGroup *group             = NULL;
+      gboolean      searchable        = FALSE;
+
+      group  = g_ptr_array_index (data->groups, i);
+      locker = bz_entry_group_lock (group);
+
+      searchable = bz_entry_group_is_searchable (group);
+      g_array_append_val (data->searchable, searchable);
+
+      /* every column keeps a slot for every group, so they stay aligned */
+      if (searchable)
+        {
+          string_column_append (&data->ids, bz_entry_group_get_id (group));
+          string_column_append (&data->titles, bz_entry_group_get_title (group));
+          token_column_append (&data->fields[FIELD_TITLE], bz_entry_group_get_title (group));
+          token_column_append (&data->fields[FIELD_DEVELOPER], bz_entry_group_get_developer (group));
+          token_column_append (&data->fields[FIELD_DESCRIPTION], bz_entry_group_get_description (group));
+          token_column_append (&data->fields[FIELD_SEARCH_TOKENS], bz_entry_group_get_search_tokens (group));
+        }
+      else
+        {
+          string_column_append (&data->ids, NULL);
+          string_column_append (&data->titles, NULL);
+          for (guint j = 0; j < N_FIELDS; j++)
+            token_column_append (&data->fields[j], NULL);
+        }
+    }
+
+  /* the arena won't move anymore, so it can back the keys */
+  for (guint i = 0; i < data->groups->len; i++)
+    {
+      const char *id = NULL;
+
+      id = string_column_get (&data->ids, i);
+      if (id != NULL)
+        g_hash_table_replace (data->id_to_idx, (gpointer) id, GUINT_TO_POINTER (i));
+    }
+
+  return dex_future_new_true ();
+}
+
+static DexFuture *
+build_boosts_fiber (BoostsData *data)
+{
+  g_autoptr (GError) local_error = NULL;
+  gboolean result                = FALSE;
+  CorpusData *corpus             = data->corpus;
+
+  result = dex_await (dex_ref (data->corpus_ready), &local_error);
+  if (!result)
+    return dex_future_new_for_error (g_steal_pointer (&local_error));
+
+  data->n_words = MAX (1, (data->biases->len + 63) / 64);
+  data->bits    = g_new0 (guint64, (gsize) corpus->groups->len * data->n_words);
+
+  for (guint i = 0; i < data->biases->len; i++)
+    {
+      BiasData      *bias  = NULL;
+      GHashTableIter iter  = { 0 };
+      gpointer       appid = NULL;
+
+      bias = g_ptr_array_index (data->biases, i);
+      if (bias->invalid || bias->boost == NULL)
+        continue;
+
+      /* the boosted apps are few, so go from them to the entries */
+      g_hash_table_iter_init (&iter, bias->boost);
+      while (g_hash_table_iter_next (&iter, &appid, NULL))
+        {
+          gpointer idx_ptr = NULL;
+          gsize    word    = 0;
+
+          if (!g_hash_table_lookup_extended (corpus->id_to_idx, appid, NULL, &idx_ptr))
+            continue;
+
+          word = (gsize) GPOINTER_TO_UINT (idx_ptr) * data->n_words + i / 64;
+          data->bits[word] |= G_GUINT64_CONSTANT (1) << (i % 64);
+        }
+    }
+
+  return dex_future_new_true ();
+}
+
+static DexFuture *
+build_index_fiber (BuildIndexData *data)
+{
+  g_autoptr (GError) local_error      = NULL;
+  gboolean             result         = FALSE;
+  TokenIndexData      *index          = data->index;
+  CorpusData          *corpus         = data->index->corpus;
+  TokenIndexData      *previous       = NULL;
+  TokenDictionaryData *dictionary     = NULL;
+  guint                first_new      = 0;
+  guint                n_postings     = 0;
+  g_autoptr (GHashTable) previous_idx = NULL;
+  g_autoptr (GArray) ids              = NULL;
+  g_autoptr (GArray) new_suffixes     = NULL;
+  g_autofree guint32 *cursors         = NULL;
+
+  if (data->previous_ready != NULL)
+    dex_await (dex_ref (data->previous_ready), NULL);
+
+  result = dex_await (dex_ref (data->corpus_ready), &local_error);
+  if (!result)
+    return dex_future_new_for_error (g_steal_pointer (&local_error));
+
+  /* Start over once the dictionary is mostly tokens nothing has anymore,
+     and whenever there is nothing finished to build on */
+  if (data->previous != NULL &&
+      g_atomic_int_get (&data->previous->ready) &&
+      data->previous->dictionary->tokens->len <= 2 * data->previous->n_live + 4096)
+    {
+      previous          = data->previous;
+      index->dictionary = token_dictionary_data_ref (previous->dictionary);
+    }
+  else
+    {
+      index->dictionary          = token_dictionary_data_new ();
+      index->dictionary->strings = g_string_chunk_new (64 * 1024);
+      index->dictionary->ids     = g_hash_table_new (g_str_hash, g_str_equal);
+      index->dictionary->tokens  = g_ptr_array_new ();
+    }
+  dictionary = index->dictionary;
+  first_new  = dictionary->tokens->len;
+
+  if (previous != NULL)
+    {
+      previous_idx = g_hash_table_new (g_direct_hash, g_direct_equal);
+      for (guint i = 0; i < previous->corpus->groups->len; i++)
+        g_hash_table_replace (
+            previous_idx,
+            g_ptr_array_index (previous->corpus->groups, i),
+            GUINT_TO_POINTER (i + 1));
+    }
+
+  index->entry_starts = g_array_sized_new (FALSE, FALSE, sizeof (guint32), corpus->groups->len + 1);
+  index->entry_tokens = g_array_new (FALSE, FALSE, sizeof (guint32));
+  ids                 = g_array_new (FALSE, FALSE, sizeof (guint32));
+
+  for (guint i = 0; i < corpus->groups->len; i++)
+    {
+      guint32 start    = 0;
+      guint   prev_idx = 0;
+      guint   kept     = 0;
+
+      start = index->entry_tokens->len;
+      g_array_append_val (index->entry_starts, start);
+      if (!g_array_index (corpus->searchable, gboolean, i))
+        continue;
+
+      /* what was in the model before and reads the same keeps its ids */
+      if (previous_idx != NULL)
+        prev_idx = GPOINTER_TO_UINT (g_hash_table_lookup (
+            previous_idx, g_ptr_array_index (corpus->groups, i)));
+      if (prev_idx > 0 &&
+          same_entry_text (previous->corpus, prev_idx - 1, corpus, i))
+        {
+          guint32 prev_start = 0;
+          guint32 prev_end   = 0;
+
+          prev_start = g_array_index (previous->entry_starts, guint32, prev_idx - 1);
+          prev_end   = g_array_index (previous->entry_starts, guint32, prev_idx);
+          g_array_append_vals (
+              index->entry_tokens,
+              &g_array_index (previous->entry_tokens, guint32, prev_start),
+              prev_end - prev_start);
+          continue;
+        }
+
+      g_array_set_size (ids, 0);
+      for (guint j = 0; j < N_FIELDS; j++)
+        {
+          TokenColumn *column = NULL;
+          guint32      first  = 0;
+          guint32      last   = 0;
+
+          column = &corpus->fields[j];
+          first  = g_array_index (column->entry_tokens, guint32, i);
+          last   = g_array_index (column->entry_tokens, guint32, i + 1);
+
+          for (guint32 t = first; t < last; t++)
+            {
+              const char *token  = NULL;
+              gpointer    id_ptr = NULL;
+              guint32     id     = 0;
+
+              token = (const char *) column->arena->data +
+                      g_array_index (column->token_offsets, guint32, t);
+              if (g_hash_table_lookup_extended (dictionary->ids, token, NULL, &id_ptr))
+                id = GPOINTER_TO_UINT (id_ptr);
+              else
+                {
+                  char *copy = NULL;
+
+                  copy = g_string_chunk_insert (dictionary->strings, token);
+                  id   = dictionary->tokens->len;
+                  g_ptr_array_add (dictionary->tokens, copy);
+                  g_hash_table_replace (dictionary->ids, copy, GUINT_TO_POINTER (id));
+                }
+              g_array_append_val (ids, id);
+            }
+        }
+
+      /* each token counts once per entry */
+      if (ids->len > 0)
+        g_array_sort (ids, cmp_guint);
+      for (guint j = 0; j < ids->len; j++)
+        {
+          if (kept > 0 &&
+              g_array_index (ids, guint32, j) == g_array_index (ids, guint32, kept - 1))
+            continue;
+          g_array_index (ids, guint32, kept++) = g_array_index (ids, guint32, j);
+        }
+      g_array_append_vals (index->entry_tokens, ids->data, kept);
+    }
+  n_postings = index->entry_tokens->len;
+  g_array_append_val (index->entry_starts, n_postings);
+
+  index->n_tokens = dictionary->tokens->len;
+  index->tokens   = g_memdup2 (dictionary->tokens->pdata, MAX (1, index->n_tokens) * sizeof (char *));
+
+  /* count the entries for each token, then lay them out */
+  index->posting_starts = g_new0 (guint32, index->n_tokens + 1);
+  for (guint i = 0; i < n_postings; i++)
+    index->posting_starts[g_array_index (index->entry_tokens, guint32, i) + 1]++;
+  for (guint i = 0; i < index->n_tokens; i++)
+    {
+      if (index->posting_starts[i + 1] > 0)
+        index->n_live++;
+      index->posting_starts[i + 1] += index->posting_starts[i];
+    }
+
+  index->postings = g_new (guint32, MAX (1, n_postings));
+  cursors         = g_memdup2 (index->posting_starts, (index->n_tokens + 1) * sizeof (guint32));
+  for (guint i = 0; i < corpus->groups->len; i++)
+    {
+      guint32 start = 0;
+      guint32 end   = 0;
+
+      start = g_array_index (index->entry_starts, guint32, i);
+      end   = g_array_index (index->entry_starts, guint32, i + 1);
+      for (guint32 j = start; j < end; j++)
+        index->postings[cursors[g_array_index (index->entry_tokens, guint32, j)]++] = i;
+    }
+
+  /* only tokens new to the dictionary need their suffixes sorted, the
+     rest are already in order from last time */
+  new_suffixes = g_array_new (FALSE, FALSE, sizeof (Suffix));
+  for (guint i = first_new; i < index->n_tokens; i++)
+    {
+      const char *token = NULL;
+
+      token = index->tokens[i];
+      for (const char *p = token; *p != '\0'; p = g_utf8_next_char (p))
+        {
+          Suffix suffix = { 0 };
+
+          suffix.token  = i;
+          suffix.offset = p - token;
+          g_array_append_val (new_suffixes, suffix);
+        }
+    }
+  g_array_sort_with_data (new_suffixes, (GCompareDataFunc) cmp_suffixes, index->tokens);
+
+  if (previous != NULL)
+    {
+      const Suffix *old   = NULL;
+      guint         n_old = 0;
+      guint         a     = 0;
+      guint         b     = 0;
+
+      old   = (const Suffix *) previous->suffixes->data;
+      n_old = previous->suffixes->len;
+
+      index->suffixes = g_array_sized_new (FALSE, FALSE, sizeof (Suffix), n_old + new_suffixes->len);
+      while (a < n_old || b < new_suffixes->len)
+        {
+          if (b >= new_suffixes->len ||
+              (a < n_old &&
+               cmp_suffixes (&old[a], &g_array_index (new_suffixes, Suffix, b), index->tokens) <= 0))
+            g_array_append_val (index->suffixes, old[a++]);
+          else
+            g_array_append_val (index->suffixes, g_array_index (new_suffixes, Suffix, b++));
+        }
+    }
+  else
+    index->suffixes = g_steal_pointer (&new_suffixes);
+
+  g_atomic_int_set (&index->ready, TRUE);
+  return dex_future_new_true ();
+}
+
+static DexFuture *
+build_prefix_table_fiber (PrefixTableData *data)
+{
+  g_autoptr (GError) local_error  = NULL;
+  gboolean        result          = FALSE;
+  TokenIndexData *index           = data->index;
+  CorpusData     *corpus          = data->index->corpus;
+  GHashTableIter  iter            = { 0 };
+  gpointer        key             = NULL;
+  g_autoptr (GHashTable) keys     = NULL;
+  g_autoptr (GPtrArray) no_biases = NULL;
+  g_autoptr (GArray) no_bits      = NULL;
+
+  result = dex_await (dex_ref (data->index_ready), &local_error);
+  if (!result)
+    return dex_future_new_for_error (g_steal_pointer (&local_error));
+  if (g_atomic_int_get (&data->superseded))
+    return dex_future_new_reject (
+        G_IO_ERROR,
+        G_IO_ERROR_CANCELLED,
+        "Prefix table was superseded");
+
+  /* every run of up to PREFIX_TABLE_MAX_CHARS characters inside a token
+     some entry has */
+  keys = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  for (guint i = 0; i < index->n_tokens; i++)
+    {
+      if (index->posting_starts[i] == index->posting_starts[i + 1])
+        continue;
+
+      for (const char *p = index->tokens[i]; *p != '\0'; p = g_utf8_next_char (p))
+        {
+          const char *end                                 = p;
+          char        buf[PREFIX_TABLE_MAX_CHARS * 6 + 1] = { 0 };
+
+          for (guint n = 0; n < PREFIX_TABLE_MAX_CHARS && *end != '\0'; n++)
+            {
+              end = g_utf8_next_char (end);
+              memcpy (buf, p, end - p);
+              buf[end - p] = '\0';
+              if (!g_hash_table_contains (keys, buf))
+                g_hash_table_add (keys, g_strdup (buf));
+            }
+        }
+    }
+
+  data->lists = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) g_array_unref);
+  no_biases   = g_ptr_array_new ();
+  no_bits     = g_array_new (FALSE, FALSE, sizeof (guint));
+
+  g_hash_table_iter_init (&iter, keys);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    {
+      char       *lookup[2]      = { key, NULL };
+      TokenColumn query          = { 0 };
+      g_autoptr (GArray) entries = NULL;
+      g_autoptr (GArray) ranked  = NULL;
+
+      if (g_atomic_int_get (&data->superseded))
+        {
+          g_clear_pointer (&data->lists, g_hash_table_unref);
+          return dex_future_new_reject (
+              G_IO_ERROR,
+              G_IO_ERROR_CANCELLED,
+              "Prefix table was superseded");
+        }
+
+      entries = lookup_token_index (index, lookup);
+      if (entries == NULL ||
+          entries->len < PREFIX_TABLE_MIN_MATCHES)
+        continue;
+
+      token_column_init (&query);
+      token_column_append (&query, key);
+
+      ranked = g_array_sized_new (FALSE, FALSE, sizeof (Score), entries->len);
+      for (guint i = 0; i < entries->len; i++)
+        {
+          Score append = { 0 };
+
+          append.idx = g_array_index (entries, guint, i);
+          append.val = score_entry (
+              corpus, &query, NULL, key,
+              no_biases, no_bits, NULL,
+              append.idx, &append.matched);
+          if (append.matched)
+            g_array_append_val (ranked, append);
+        }
+      token_column_clear (&query);
+
+      if (ranked->len > 0)
+        g_array_sort (ranked, (GCompareFunc) cmp_scores);
+      g_hash_table_replace (data->lists, g_strdup (key), g_steal_pointer (&ranked));
+    }
+
+  g_atomic_int_set (&data->ready, TRUE);
+  return dex_future_new_true ();
+}
+
+static void
+corpus_clear (gpointer ptr)
+{
+  CorpusData *self = ptr;
+
+  g_clear_pointer (&self->groups, g_ptr_array_unref);
+  g_clear_pointer (&self->searchable, g_array_unref);
+  g_clear_pointer (&self->id_to_idx, g_hash_table_unref);
+  string_column_clear (&self->ids);
+  string_column_clear (&self->titles);
+  for (guint i = 0; i < N_FIELDS; i++)
+    token_column_clear (&self->fields[i]);
+}
+
+static void
+string_column_init (StringColumn *column)
+{
+  column->arena   = g_byte_array_new ();
+  column->offsets = g_array_new (FALSE, FALSE, sizeof (guint32));
+}
+
+static void
+string_column_clear (StringColumn *column)
+{
+  g_clear_pointer (&column->arena, g_byte_array_unref);
+  g_clear_pointer (&column->offsets, g_array_unref);
+}
+
+static void
+string_column_append (StringColumn *column,
+                      const char   *str)
+{
+  guint32 offset = G_MAXUINT32;
+
+  if (str != NULL)
+    {
+      offset = column->arena->len;
+      g_byte_array_append (column->arena, (const guint8 *) str, strlen (str) + 1);
+    }
+
+  g_array_append_val (column->offsets, offset);
+}
+
+static inline const char *
+string_column_get (const StringColumn *column,
+                   guint               idx)
+{
+  guint32 offset = 0;
+
+  offset = g_array_index (column->offsets, guint32, idx);
+  if (offset == G_MAXUINT32)
+    return NULL;
+
+  return (const char *) column->arena->data + offset;
+}
+
+static void
+token_column_init (TokenColumn *column)
+{
+  guint32 first = 0;
+
+  column->arena         = g_byte_array_new ();
+  column->token_offsets = g_array_new (FALSE, FALSE, sizeof (guint32));
+  column->token_bytes   = g_array_new (FALSE, FALSE, sizeof (guint32));
+  column->token_chars   = g_array_new (FALSE, FALSE, sizeof (guint32));
+  column->entry_tokens  = g_array_new (FALSE, FALSE, sizeof (guint32));
+
+  g_array_append_val (column->entry_tokens, first);
+}
+
+static void
+token_column_clear (TokenColumn *column)
+{
+  g_clear_pointer (&column->arena, g_byte_array_unref);
+  g_clear_pointer (&column->token_offsets, g_array_unref);
+  g_clear_pointer (&column->token_bytes, g_array_unref);
+  g_clear_pointer (&column->token_chars, g_array_unref);
+  g_clear_pointer (&column->entry_tokens, g_array_unref);
+}
+
+static void
+token_column_append (TokenColumn *column,
+                     const char  *str)
+{
+  guint32 offset = 0;
+  guint32 chars  = 0;
+  guint32 n      = 0;
+
+#define END_TOKEN()                                                 \
+  G_STMT_START                                                      \
+  {                                                                 \
+    n = column->arena->len - offset;                                \
+    g_byte_array_append (column->arena, (const guint8 *) "", 1);    \
+    g_array_append_val (column->token_offsets, offset);             \
+    g_array_append_val (column->token_bytes, n);                    \
+    g_array_append_val (column->token_chars, chars);                \
+    chars = 0;                                                      \
+  }                                                                 \
+  G_STMT_END
+
+  for (const char *p = str; p != NULL && *p != '\0'; p = g_utf8_next_char (p))
+    {
+      gunichar ch      = 0;
+      char     buf[6]  = { 0 };
+      gint     buf_len = 0;
+
+      ch = g_utf8_get_char (p);
+      if (g_unichar_type (ch) == G_UNICODE_SPACE_SEPARATOR)
+        {
+          if (chars > 0)
+            END_TOKEN ();
+          continue;
+        }
+
+      if (chars == 0)
+        offset = column->arena->len;
+
+      buf_len = g_unichar_to_utf8 (g_unichar_tolower (ch), buf);
+      g_byte_array_append (column->arena, (const guint8 *) buf, buf_len);
+      chars++;
+    }
+  if (chars > 0)
+    END_TOKEN ();
+
+#undef END_TOKEN
+
+  n = column->token_offsets->len;
+  g_array_append_val (column->entry_tokens, n);
+}
+
+static DexFuture *
+query_task_fiber (QueryTaskData *data)
+{
+  char      **terms                          = data->terms;
+  CorpusData *corpus                         = data->corpus;
+  GPtrArray  *biases                         = data->biases;
+  g_autoptr (GError) local_error             = NULL;
+  gboolean result                            = FALSE;
+  gint64   started_at                        = 0;
+  gint64   snapshot_at                       = 0;
+  gint64   biased_at                         = 0;
+  gint64   scanned_at                        = 0;
+  gint64   sorted_at                         = 0;
+  gint64   built_at                          = 0;
+  g_autofree char *query_utf8                = NULL;
+  double           threshold                 = 1.0;
+  guint            n_results                 = 0;
+  guint            n_scanned                 = 0;
+  guint            n_matched                 = 0;
+  GArray          *ranked                    = NULL;
+  g_auto (GStrv) tokens                      = NULL;
+  g_autoptr (LastMatchData) last             = NULL;
+  g_autoptr (WorkData) work                  = NULL;
+  g_autoptr (GArray) matched                 = NULL;
+  g_autoptr (GPtrArray) active_biases        = NULL;
+  g_autoptr (GArray) active_bits             = NULL;
+  g_autoptr (GPtrArray) runs                 = NULL;
+  g_autofree guint *heads                    = NULL;
+  g_autoptr (GArray) head                    = NULL;
+  g_autoptr (GArray) tail                    = NULL;
+  g_autoptr (GArray) indices                 = NULL;
+  g_autoptr (GArray) values                  = NULL;
+  g_autoptr (BzSearchResults) results        = NULL;
+  g_autoptr (BzFinishedSearchQuery) finished = NULL;
+
+  started_at = g_get_monotonic_time ();
+
+  /* the corpus and boosts are built off the model in the background, so
+     right after it changed this waits on that */
+  result = dex_await (dex_ref (data->boosts_ready), &local_error);
+  if (!result)
+    return dex_future_new_for_error (g_steal_pointer (&local_error));
+  if (query_superseded (data->cancellable))
+    return new_superseded_error ();
+  snapshot_at = g_get_monotonic_time ();
+
+  query_utf8 = g_strjoinv (" ", terms);
+
+  active_biases = g_ptr_array_new_with_free_func (bias_data_unref);
+  active_bits   = g_array_new (FALSE, FALSE, sizeof (guint));
+  for (guint i = 0; i < biases->len; i++)
+    {
+      BiasData *bias = NULL;
+
+      bias = g_ptr_array_index (biases, i);
+      if (bias->invalid)
+        continue;
+
+      if (!g_regex_match (bias->regex, query_utf8, G_REGEX_MATCH_DEFAULT, NULL))
+        continue;
+
+      if (bias->convert_to != NULL)
+        {
+          g_autofree char *tmp = NULL;
+
+          tmp = g_regex_replace (
+              bias->regex, query_utf8,
+              -1, 0, bias->convert_to,
+              G_REGEX_MATCH_DEFAULT, NULL);
+          if (tmp != NULL)
+            {
+              g_clear_pointer (&query_utf8, g_free);
+              query_utf8 = g_steal_pointer (&tmp);
+            }
+        }
+
+      g_ptr_array_add (active_biases, bias_data_ref (bias));
+      g_array_append_val (active_bits, i);
+    }
+  biased_at = g_get_monotonic_time ();
+
+  /* when the user just typed more, only rescore what matched before */
+  tokens = tokenize_query (query_utf8);
+
+  g_mutex_lock (&data->state->mutex);
+  if (data->state->last != NULL)
+    last = last_match_data_ref (data->state->last);
+  g_mutex_unlock (&data->state->mutex);
+
+  /* the shortest queries are only ever looked up */
+  ranked = lookup_prefix_table (data->prefixes, corpus, query_utf8, tokens, active_biases);
+
+  work = work_data_new ();
+  if (ranked != NULL)
+    work->candidates = g_array_new (FALSE, FALSE, sizeof (guint));
+  else if (last != NULL &&
+           last->corpus == corpus &&
+           query_refines (last->tokens, tokens))
+    work->candidates = collect_candidates (corpus, last->matched, query_utf8, active_biases);
+  else if (data->index->corpus == corpus &&
+           g_atomic_int_get (&data->index->ready))
+    {
+      g_autoptr (GArray) postings = NULL;
+
+      /* otherwise ask the index which entries have every token at all */
+      postings = lookup_token_index (data->index, tokens);
+      if (postings != NULL)
+        work->candidates = collect_candidates (corpus, postings, query_utf8, active_biases);
+    }
+  work->length = work->candidates != NULL ? work->candidates->len : corpus->groups->len;
+
+  if (ranked != NULL)
+    {
+      runs = g_ptr_array_new_with_free_func ((GDestroyNotify) g_array_unref);
+      g_ptr_array_add (runs, g_array_ref (ranked));
+    }
+  else
+    {
+      runs = score_work (
+          data, query_utf8, work, threshold,
+          active_biases, active_bits, FALSE, &local_error);
+      if (runs == NULL)
+        return dex_future_new_for_error (g_steal_pointer (&local_error));
+    }
+
+  matched = g_array_new (FALSE, FALSE, sizeof (guint));
+  for (guint i = 0; i < runs->len; i++)
+    {
+      GArray *run = NULL;
+
+      run = g_ptr_array_index (runs, i);
+      for (guint j = 0; j < run->len; j++)
+        {
+          if (g_array_index (run, Score, j).matched)
+            g_array_append_val (matched, g_array_index (run, Score, j).idx);
+          if (g_array_index (run, Score, j).val > threshold)
+            n_results++;
+        }
+    }
+  if (matched->len > 0)
+    g_array_sort (matched, cmp_guint);
+
+  n_scanned = work->length;
+  n_matched = matched->len;
+
+  /* Next to nothing matched as typed, so look for near misses among
+     everything else. These stay out of `matched`, which only ever holds
+     exact matches so refining the query later remains sound. */
+  if (data->fuzzy &&
+      n_results < FUZZY_MAX_RESULTS &&
+      query_allows_typos (tokens))
+    {
+      g_autoptr (WorkData) fuzzy_work  = NULL;
+      g_autoptr (GPtrArray) fuzzy_runs = NULL;
+
+      fuzzy_work             = work_data_new ();
+      fuzzy_work->candidates = collect_unscored (corpus, runs);
+      fuzzy_work->length     = fuzzy_work->candidates->len;
+
+      fuzzy_runs = score_work (
+          data, query_utf8, fuzzy_work, threshold,
+          active_biases, active_bits, TRUE, &local_error);
+      if (fuzzy_runs == NULL)
+        return dex_future_new_for_error (g_steal_pointer (&local_error));
+
+      n_scanned += fuzzy_work->length;
+      for (guint i = 0; i < fuzzy_runs->len; i++)
+        {
+          GArray *run = NULL;
+
+          run = g_ptr_array_index (fuzzy_runs, i);
+          for (guint j = 0; j < run->len; j++)
+            {
+              if (g_array_index (run, Score, j).matched)
+                n_matched++;
+            }
+        }
+
+      g_ptr_array_extend_and_steal (runs, g_steal_pointer (&fuzzy_runs));
+    }
+  scanned_at = g_get_monotonic_time ();
+
+  /* every sub task ranked its best HEAD_SIZE already, and the overall best
+     are among those */
+  heads = g_new0 (guint, runs->len);
+  head  = merge_sorted_runs (runs, heads, threshold, HEAD_SIZE);
+  tail  = collect_tail (runs, heads, threshold);
+  sorted_at = g_get_monotonic_time ();
+
+  if (query_superseded (data->cancellable))
+    return new_superseded_error ();
+
+  g_clear_pointer (&last, last_match_data_unref);
+  last          = last_match_data_new ();
+  last->corpus  = corpus_data_ref (corpus);
+  last->tokens  = g_steal_pointer (&tokens);
+  last->matched = g_steal_pointer (&matched);
+
+  g_mutex_lock (&data->state->mutex);
+  g_clear_pointer (&data->state->last, last_match_data_unref);
+  data->state->last = last_match_data_ref (last);
+  g_mutex_unlock (&data->state->mutex);
+
+  /* the result objects are only made for what actually gets shown; the
+     tail goes in unranked for now so the count is right from the start */
+  indices = g_array_sized_new (FALSE, FALSE, sizeof (guint), head->len + tail->len);
+  values  = g_array_sized_new (FALSE, FALSE, sizeof (double), head->len + tail->len);
+  for (guint i = 0; i < head->len; i++)
+    {
+      g_array_append_val (indices, g_array_index (head, Score, i).idx);
+      g_array_append_val (values, g_array_index (head, Score, i).val);
+    }
+  for (guint i = 0; i < tail->len; i++)
+    {
+      g_array_append_val (indices, g_array_index (tail, Score, i).idx);
+      g_array_append_val (values, g_array_index (tail, Score, i).val);
+    }
+  results  = bz_search_results_new (corpus->groups, indices, values);
+  built_at = g_get_monotonic_time ();
+
+  finished = bz_finished_search_query_new ();
+  bz_finished_search_query_set_interpreted_query (finished, query_utf8);
+  bz_finished_search_query_set_results (finished, G_LIST_MODEL (results));
+  bz_finished_search_query_set_n_results (finished, head->len + tail->len);
+  bz_finished_search_query_set_n_scanned (finished, n_scanned);
+  bz_finished_search_query_set_n_matched (finished, n_matched);
+  bz_finished_search_query_set_elapsed (finished, USEC_TO_SEC (built_at - started_at));
+  bz_finished_search_query_set_snapshot_elapsed (finished, USEC_TO_SEC (snapshot_at - started_at));
+  bz_finished_search_query_set_bias_elapsed (finished, USEC_TO_SEC (biased_at - snapshot_at));
+  bz_finished_search_query_set_scan_elapsed (finished, USEC_TO_SEC (scanned_at - biased_at));
+  bz_finished_search_query_set_sort_elapsed (finished, USEC_TO_SEC (sorted_at - scanned_at));
+  bz_finished_search_query_set_build_elapsed (finished, USEC_TO_SEC (built_at - sorted_at));
+
+  data->results  = g_object_ref (results);
+  data->finished = g_object_ref (finished);
+  dex_promise_resolve_object (data->head, g_steal_pointer (&finished));
+
+  if (tail->len <= 1)
+    return dex_future_new_true ();
+
+  sorted_at = g_get_monotonic_time ();
+  g_array_sort (tail, (GCompareFunc) cmp_scores);
+  if (query_superseded (data->cancellable))
+    return new_superseded_error ();
+  data->tail_sort_elapsed = USEC_TO_SEC (g_get_monotonic_time () - sorted_at);
+
+  data->tail_position = head->len;
+  data->tail_indices  = g_array_sized_new (FALSE, FALSE, sizeof (guint), tail->len);
+  data->tail_values   = g_array_sized_new (FALSE, FALSE, sizeof (double), tail->len);
+  for (guint i = 0; i < tail->len; i++)
+    {
+      g_array_append_val (data->tail_indices, g_array_index (tail, Score, i).idx);
+      g_array_append_val (data->tail_values, g_array_index (tail, Score, i).val);
+    }
+
+  return dex_future_new_true ();
+}
+
+/* Scores `work` across the thread pool and returns what each sub task
+ * found, with its best HEAD_SIZE at the front */
+static GPtrArray *
+score_work (QueryTaskData *data,
+            const char    *query_utf8,
+            WorkData      *work,
+            double         threshold,
+            GPtrArray     *active_biases,
+            GArray        *active_bits,
+            gboolean       fuzzy,
+            GError       **error)
+{
+  guint n_sub_tasks                 = 0;
+  g_autoptr (GPtrArray) sub_futures = NULL;
+  g_autoptr (GPtrArray) runs        = NULL;
+  gboolean result                   = FALSE;
+
+  n_sub_tasks = MAX (1, MIN (work->length / 512, g_get_num_processors ()));
+
+  sub_futures = g_ptr_array_new_with_free_func (dex_unref);
+  for (guint i = 0; i < n_sub_tasks; i++)
+    {
+      g_autoptr (QuerySubTaskData) sub_data = NULL;
+      g_autoptr (DexFuture) future          = NULL;
+
+      sub_data                = query_sub_task_data_new ();
+      sub_data->query_utf8    = g_strdup (query_utf8);
+      sub_data->corpus        = corpus_data_ref (data->corpus);
+      sub_data->work          = work_data_ref (work);
+      sub_data->threshold     = threshold;
+      sub_data->active_biases = g_ptr_array_ref (active_biases);
+      sub_data->active_bits   = g_array_ref (active_bits);
+      sub_data->boosts        = boosts_data_ref (data->boosts);
+      sub_data->fuzzy         = fuzzy;
+      sub_data->cancellable   = g_object_ref (data->cancellable);
+
+      future = dex_scheduler_spawn (
+          dex_thread_pool_scheduler_get_default (),
+          bz_get_dex_stack_size (),
+          (DexFiberFunc) query_sub_task_fiber,
+          query_sub_task_data_ref (sub_data),
+          query_sub_task_data_unref);
+
+      g_ptr_array_add (sub_futures, g_steal_pointer (&future));
     }
-  if (scores->len > 0)
-    g_array_sort (scores, (GCompareFunc) cmp_scores);
 
-  results = g_ptr_array_new_with_free_func (g_object_unref);
-  g_ptr_array_set_size (results, scores->len);
-  for (guint i = 0; i < scores->len; i++)
+  result = dex_await (dex_future_allv (
+                          (DexFuture *const *) sub_futures->pdata, sub_futures->len),
+                      error);
+  if (!result)
+    return NULL;
+
+  runs = g_ptr_array_new_with_free_func ((GDestroyNotify) g_array_unref);
+  for (guint i = 0; i < sub_futures->len; i++)
     {
-      Score        *score                      = NULL;
-      BzEntryGroup *group                      = NULL;
-      g_autoptr (BzSearchResult) search_result = NULL;
+      DexFuture *future = NULL;
 
-      score = &g_array_index (scores, Score, i);
-      group = g_ptr_array_index (shallow_mirror, score->idx);
+      future = g_ptr_array_index (sub_futures, i);
+      g_ptr_array_add (runs, g_array_ref (g_value_get_boxed (dex_future_get_value (future, NULL))));
+    }
 
-      search_result = bz_search_result_new ();
-      bz_search_result_set_group (search_result, group);
-      bz_search_result_set_original_index (search_result, score->idx);
-      bz_search_result_set_score (search_result, score->val);
+  return g_steal_pointer (&runs);
+}
 
-      g_ptr_array_index (results, i) = g_steal_pointer (&search_result);
-    }
+static DexFuture *
+query_tail_then (DexFuture     *future,
+                 QueryTaskData *data)
+{
+  guint n_recent = 0;
+
+  if (data->tail_indices != NULL)
+    bz_search_results_replace_tail (
+        data->results, data->tail_position,
+        data->tail_indices, data->tail_values);
+
+  /* the rest were ranked after the caller got the results, so the sort
+     phase only becomes complete here */
+  if (data->tail_sort_elapsed > 0.0)
+    bz_finished_search_query_set_sort_elapsed (
+        data->finished,
+        bz_finished_search_query_get_sort_elapsed (data->finished) +
+            data->tail_sort_elapsed);
+
+  n_recent = g_list_model_get_n_items (G_LIST_MODEL (data->recent_queries));
+  if (n_recent >= RECENT_QUERIES)
+    g_list_store_splice (data->recent_queries, 0, n_recent - RECENT_QUERIES + 1, NULL, 0);
+  g_list_store_append (data->recent_queries, data->finished);
+
+  return NULL;
+}
 
-  finished = bz_finished_search_query_new ();
-  bz_finished_search_query_set_interpreted_query (finished, query_utf8);
-  bz_finished_search_query_set_results (finished, results);
-  bz_finished_search_query_set_n_results (finished, results->len);
-  bz_finished_search_query_set_elapsed (finished, g_timer_elapsed (timer, NULL));
+static DexFuture *
+query_task_catch (DexFuture     *future,
+                  QueryTaskData *data)
+{
+  g_autoptr (GError) local_error = NULL;
+
+  dex_future_get_value (future, &local_error);
+  if (dex_future_is_pending (DEX_FUTURE (data->head)))
+    dex_promise_reject (data->head, g_steal_pointer (&local_error));
 
-  return dex_future_new_for_object (finished);
+  return NULL;
 }
 
 static DexFuture *
 query_sub_task_fiber (QuerySubTaskData *data)
 {
-  GPtrArray *shallow_mirror     = data->shallow_mirror;
-  char      *query_utf8         = data->query_utf8;
-  double     threshold          = data->threshold;
-  guint      work_offset        = data->work_offset;
-  guint      work_length        = data->work_length;
-  GPtrArray *active_biases      = data->active_biases;
-  g_autoptr (GArray) scores_out = NULL;
+  CorpusData *corpus             = data->corpus;
+  WorkData   *work               = data->work;
+  char       *query_utf8         = data->query_utf8;
+  double      threshold          = data->threshold;
+  GPtrArray  *active_biases      = data->active_biases;
+  TokenColumn query              = { 0 };
+  g_autofree FuzzyPattern *fuzzy = NULL;
+  g_autoptr (GArray) scores_out  = NULL;
+  gboolean superseded            = FALSE;
+
+  token_column_init (&query);
+  token_column_append (&query, query_utf8);
+  if (data->fuzzy)
+    fuzzy = build_fuzzy_patterns (&query);
 
   scores_out = g_array_new (FALSE, FALSE, sizeof (Score));
 
-  for (guint i = 0; i < work_length; i++)
+  for (;;)
     {
-      g_autoptr (GMutexLocker) locker = NULL;
-      BzEntryGroup *group             = NULL;
-      const char   *id                = NULL;
-      const char   *title             = NULL;
-      double        score             = 0.0;
+      guint start = 0;
+      guint end   = 0;
 
-      group  = g_ptr_array_index (shallow_mirror, work_offset + i);
-      locker = bz_entry_group_lock (group);
+      if (query_superseded (data->cancellable))
+        {
+          superseded = TRUE;
+          break;
+        }
+
+      start = (guint) g_atomic_int_add (&work->cursor, WORK_CHUNK_SIZE);
+      if (start >= work->length)
+        break;
+      end = MIN (start + WORK_CHUNK_SIZE, work->length);
+
+      for (guint i = start; i < end; i++)
+        {
+          guint    idx     = 0;
+          double   score   = 0.0;
+          gboolean matched = FALSE;
+
+          idx = work->candidates != NULL
+                    ? g_array_index (work->candidates, guint, i)
+                    : i;
+          if (!g_array_index (corpus->searchable, gboolean, idx))
+            continue;
+
+          score = score_entry (
+              corpus, &query, fuzzy, query_utf8,
+              active_biases, data->active_bits, data->boosts,
+              idx, &matched);
+          if (matched || score > threshold)
+            {
+              Score append = { 0 };
+
+              append.idx     = idx;
+              append.val     = score;
+              append.matched = matched;
+              g_array_append_val (scores_out, append);
+            }
+        }
+    }
+
+  token_column_clear (&query);
+
+  if (superseded)
+    return new_superseded_error ();
+
+  select_top (scores_out, HEAD_SIZE);
+  return dex_future_new_take_boxed (G_TYPE_ARRAY, g_steal_pointer (&scores_out));
+}
+
+/* Scores entry `idx` and applies the biases. `matched_out` tells whether the
+ * text itself matched, as opposed to a bias lifting the score. `patterns`
+ * is only given for the typo tolerant pass. */
+static double
+score_entry (CorpusData         *corpus,
+             const TokenColumn  *query,
+             const FuzzyPattern *patterns,
+             const char         *query_utf8,
+             GPtrArray          *active_biases,
+             GArray             *active_bits,
+             BoostsData         *boosts,
+             guint               idx,
+             gboolean           *matched_out)
+{
+  const char *id    = NULL;
+  const char *title = NULL;
+  double      score = 0.0;
+
+  id    = string_column_get (&corpus->ids, idx);
+  title = string_column_get (&corpus->titles, idx);
+  if ((id != NULL && g_strcmp0 (query_utf8, id) == 0) ||
+      (title != NULL && strcasecmp (query_utf8, title) == 0))
+    score = (double) G_MAXINT;
+  else
+    {
+      for (guint j = 0; j < N_FIELDS; j++)
+        score += test_strings (
+                     query, patterns, &corpus->fields[j], idx,
+                     field_scoring[j].accept_min_size) *
+                 field_scoring[j].weight;
+    }
+  *matched_out = score > 0.0;
 
-      if (!bz_entry_group_is_searchable (group))
+  for (guint j = 0; j < active_biases->len; j++)
+    {
+      BiasData *bias = NULL;
+
+      bias = g_ptr_array_index (active_biases, j);
+      if (!BOOSTS_TEST (boosts, idx, g_array_index (active_bits, guint, j)))
         continue;
 
-      id    = bz_entry_group_get_id (group);
-      title = bz_entry_group_get_title (group);
-      if ((id != NULL && g_strcmp0 (query_utf8, id) == 0) ||
-          (title != NULL && strcasecmp (query_utf8, title) == 0))
-        score = (double) G_MAXINT;
-      else
+      switch (bias->boost_kind)
         {
-          const char *developer     = NULL;
-          const char *description   = NULL;
-          const char *search_tokens = NULL;
+        case LINEAR:
+          score = bias->linear_boost.slope * score + bias->linear_boost.y_intercept;
+          break;
+        case EXPONENTIAL:
+          score = pow (bias->exponential_boost.factor, score) * bias->exponential_boost.y_intercept;
+          break;
+        default:
+          break;
+        }
+    }
+
+  return score;
+}
+
+/* Moves the `n` best of `scores` to the front, best first, and leaves the
+ * rest behind them in no particular order */
+static void
+select_top (GArray *scores,
+            guint   n)
+{
+  Score *data = NULL;
+  gssize lo   = 0;
+  gssize hi   = 0;
+  gssize k    = 0;
+
+  n = MIN (n, scores->len);
+  if (n == 0)
+    return;
+
+  data = (Score *) scores->data;
+  hi   = (gssize) scores->len - 1;
+  k    = (gssize) n - 1;
+
+  /* quickselect, so that the k-th best ends up at `k`; ordering by
+     cmp_scores () rather than the value alone decides ties the same way
+     the sort below does */
+  while (lo < hi)
+    {
+      Score  pivot = { 0 };
+      gssize i     = 0;
+      gssize j     = 0;
 
-          developer     = bz_entry_group_get_developer (group);
-          description   = bz_entry_group_get_description (group);
-          search_tokens = bz_entry_group_get_search_tokens (group);
+      pivot = data[lo + (hi - lo) / 2];
+      i     = lo;
+      j     = hi;
 
-#define EVALUATE_STRING(_s, _accept_min_size)                  \
-  ((_s) != NULL                                                \
-       ? (test_strings (query_utf8, (_s), (_accept_min_size))) \
-       : 0.0)
+      while (i <= j)
+        {
+          while (cmp_scores (&data[i], &pivot) < 0)
+            i++;
+          while (cmp_scores (&data[j], &pivot) > 0)
+            j--;
 
-          score += EVALUATE_STRING (title, 2) * 2.0;
-          score += EVALUATE_STRING (developer, 2) * 1.0;
-          score += EVALUATE_STRING (description, 3) * 1.0;
-          score += EVALUATE_STRING (search_tokens, -1) * 1.5;
+          if (i <= j)
+            {
+              Score tmp = data[i];
 
-#undef EVALUATE_STRING
+              data[i] = data[j];
+              data[j] = tmp;
+              i++;
+              j--;
+            }
         }
 
-      for (guint j = 0; j < active_biases->len; j++)
+      if (k <= j)
+        hi = j;
+      else if (k >= i)
+        lo = i;
+      else
+        break;
+    }
+
+  qsort (data, n, sizeof (Score), (int (*) (const void *, const void *)) cmp_scores);
+}
+
+/* Merges up to `limit` entries from the fronts of `runs`, which have to be
+ * sorted that far, best first. `heads` tracks how much of each run has been
+ * taken. Entries at or below `threshold` are left alone; since the runs
+ * are sorted, a run is done as soon as its head falls below it. */
+static GArray *
+merge_sorted_runs (GPtrArray *runs,
+                   guint     *heads,
+                   double     threshold,
+                   guint      limit)
+{
+  g_autoptr (GArray) merged = NULL;
+
+  merged = g_array_new (FALSE, FALSE, sizeof (Score));
+
+  while (merged->len < limit)
+    {
+      Score *best     = NULL;
+      guint  best_run = 0;
+
+      for (guint i = 0; i < runs->len; i++)
         {
-          BiasData *bias = NULL;
+          GArray *run  = NULL;
+          Score  *head = NULL;
 
-          bias = g_ptr_array_index (active_biases, j);
-          if (bias->boost == NULL)
+          run = g_ptr_array_index (runs, i);
+          if (heads[i] >= run->len)
             continue;
 
-          if (!g_hash_table_contains (bias->boost, id))
+          head = &g_array_index (run, Score, heads[i]);
+          if (head->val <= threshold)
             continue;
 
-          switch (bias->boost_kind)
+          if (best == NULL || cmp_scores (head, best) < 0)
             {
-            case LINEAR:
-              score = bias->linear_boost.slope * score + bias->linear_boost.y_intercept;
-              break;
-            case EXPONENTIAL:
-              score = pow (bias->exponential_boost.factor, score) * bias->exponential_boost.y_intercept;
-              break;
-            default:
-              break;
+              best     = head;
+              best_run = i;
             }
         }
 
-      if (score > threshold)
+      if (best == NULL)
+        break;
+
+      g_array_append_val (merged, *best);
+      heads[best_run]++;
+    }
+
+  return g_steal_pointer (&merged);
+}
+
+/* Gathers what merge_sorted_runs () left over above `threshold`, unsorted */
+static GArray *
+collect_tail (GPtrArray   *runs,
+              const guint *heads,
+              double       threshold)
+{
+  g_autoptr (GArray) tail = NULL;
+
+  tail = g_array_new (FALSE, FALSE, sizeof (Score));
+
+  for (guint i = 0; i < runs->len; i++)
+    {
+      GArray *run = NULL;
+
+      run = g_ptr_array_index (runs, i);
+      for (guint j = heads[i]; j < run->len; j++)
         {
-          Score append = { 0 };
+          if (g_array_index (run, Score, j).val > threshold)
+            g_array_append_val (tail, g_array_index (run, Score, j));
+        }
+    }
+
+  return g_steal_pointer (&tail);
+}
+
+static inline gboolean
+query_superseded (GCancellable *cancellable)
+{
+  return g_cancellable_is_cancelled (cancellable);
+}
+
+static inline DexFuture *
+new_superseded_error (void)
+{
+  return dex_future_new_reject (
+      G_IO_ERROR,
+      G_IO_ERROR_CANCELLED,
+      "Query was superseded");
+}
+
+static char **
+tokenize_query (const char *query)
+{
+  TokenColumn column           = { 0 };
+  g_autoptr (GStrvBuilder) out = NULL;
+
+  token_column_init (&column);
+  token_column_append (&column, query);
+
+  out = g_strv_builder_new ();
+  for (guint i = 0; i < column.token_offsets->len; i++)
+    g_strv_builder_add (
+        out, (const char *) column.arena->data +
+                 g_array_index (column.token_offsets, guint32, i));
+
+  token_column_clear (&column);
+  return g_strv_builder_end (out);
+}
+
+/* Whether everything matching `tokens` is sure to have matched `previous`,
+ * which holds as long as each earlier token is inside its replacement;
+ * any tokens past the earlier ones only narrow things down further */
+static gboolean
+query_refines (char **previous,
+               char **tokens)
+{
+  guint n_previous = 0;
+
+  n_previous = g_strv_length (previous);
+  if (n_previous > g_strv_length (tokens))
+    return FALSE;
+
+  for (guint i = 0; i < n_previous; i++)
+    {
+      if (strstr (tokens[i], previous[i]) == NULL)
+        return FALSE;
+    }
 
-          append.idx = work_offset + i;
-          append.val = score;
-          g_array_append_val (scores_out, append);
+  return TRUE;
+}
+
+/* Whether some token is long enough to be matched with typos at all */
+static gboolean
+query_allows_typos (char **tokens)
+{
+  for (guint i = 0; tokens[i] != NULL; i++)
+    {
+      if (g_utf8_strlen (tokens[i], -1) >= FUZZY_MIN_CHARS &&
+          strlen (tokens[i]) <= 64)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* Every searchable entry that none of `runs` holds, in corpus order */
+static GArray *
+collect_unscored (CorpusData *corpus,
+                  GPtrArray  *runs)
+{
+  g_autoptr (GArray) scored     = NULL;
+  g_autoptr (GArray) candidates = NULL;
+  guint next                    = 0;
+
+  scored = g_array_new (FALSE, FALSE, sizeof (guint));
+  for (guint i = 0; i < runs->len; i++)
+    {
+      GArray *run = NULL;
+
+      run = g_ptr_array_index (runs, i);
+      for (guint j = 0; j < run->len; j++)
+        g_array_append_val (scored, g_array_index (run, Score, j).idx);
+    }
+  if (scored->len > 0)
+    g_array_sort (scored, cmp_guint);
+
+  candidates = g_array_sized_new (FALSE, FALSE, sizeof (guint), corpus->groups->len - scored->len);
+  for (guint i = 0; i < corpus->groups->len; i++)
+    {
+      if (next < scored->len &&
+          g_array_index (scored, guint, next) == i)
+        {
+          next++;
+          continue;
         }
+      if (g_array_index (corpus->searchable, gboolean, i))
+        g_array_append_val (candidates, i);
     }
 
-  return dex_future_new_take_boxed (G_TYPE_ARRAY, g_steal_pointer (&scores_out));
+  return g_steal_pointer (&candidates);
+}
+
+/* The results for a query of a single short token, already ranked, or
+ * NULL when it has to be scored. The table was scored with the token
+ * itself as the query, which makes no difference to the exact title match
+ * as long as the query only differs in ASCII case, and none to the exact
+ * id match unless some id is the query as typed. */
+static GArray *
+lookup_prefix_table (PrefixTableData *prefixes,
+                     CorpusData      *corpus,
+                     const char      *query_utf8,
+                     char           **tokens,
+                     GPtrArray       *active_biases)
+{
+  if (prefixes->index->corpus != corpus ||
+      !g_atomic_int_get (&prefixes->ready))
+    return NULL;
+
+  if (active_biases->len > 0 ||
+      g_strv_length (tokens) != 1 ||
+      g_utf8_strlen (tokens[0], -1) > PREFIX_TABLE_MAX_CHARS)
+    return NULL;
+
+  if (g_ascii_strcasecmp (query_utf8, tokens[0]) != 0)
+    return NULL;
+  if (strcmp (query_utf8, tokens[0]) != 0 &&
+      g_hash_table_contains (corpus->id_to_idx, query_utf8))
+    return NULL;
+
+  return g_hash_table_lookup (prefixes->lists, tokens[0]);
 }
 
-#define UTF8_FOREACH_FORWARD(_var, _s) \
-  for (const char *_var = (_s);        \
-       _var != NULL && *_var != '\0';  \
-       _var = g_utf8_next_char (_var))
+/* The entries that contain every one of `tokens` somewhere, in corpus
+ * order, or NULL when there are too many tokens to tell */
+static GArray *
+lookup_token_index (TokenIndexData *index,
+                    char          **tokens)
+{
+  guint n_query                 = 0;
+  g_autofree guint8 *hits       = NULL;
+  g_autoptr (GArray) candidates = NULL;
+  guint n_entries               = 0;
 
-#define UTF8_FOREACH_FORWARD_WITH_END(_var, _s, _end)  \
-  for (const char *_var = (_s);                        \
-       _var != NULL && *_var != '\0' && _var < (_end); \
-       _var = g_utf8_next_char (_var))
+  n_query = g_strv_length (tokens);
+  if (n_query == 0 || n_query > G_MAXUINT8)
+    return NULL;
 
-#define UTF8_FOREACH_BACKWARD(_var, _s, _start) \
-  for (const char *_var = (_s);                 \
-       _var != NULL && _var >= (_start);        \
-       _var = g_utf8_prev_char (_var))
+  /* `hits[i]` is how many of the tokens so far entry `i` had, so an entry
+     only moves on while it has all of them */
+  n_entries = index->corpus->groups->len;
+  hits      = g_new0 (guint8, MAX (1, n_entries));
 
-#define UTF8_FOREACH_TOKEN_FORWARDS(_start_var, _end_var, _s, _token_len)                                                            \
-  for (const char *_start_var = (_s), *_end_var = utf8_skip_to_next_of_class (&_start_var, G_UNICODE_SPACE_SEPARATOR, (_token_len)); \
-       _start_var != NULL && *_start_var != '\0';                                                                                    \
-       _start_var = _end_var, _end_var = utf8_skip_to_next_of_class (&_start_var, G_UNICODE_SPACE_SEPARATOR, (_token_len)))
+  for (guint q = 0; q < n_query; q++)
+    {
+      const char *token     = NULL;
+      gsize       length    = 0;
+      guint       lo        = 0;
+      guint       hi        = 0;
+      guint       n_present = 0;
 
-static double
-test_strings (const char *query,
-              const char *against,
-              gssize      accept_min_size)
+      token  = tokens[q];
+      length = strlen (token);
+
+      hi = index->suffixes->len;
+      while (lo < hi)
+        {
+          guint   mid    = 0;
+          Suffix *suffix = NULL;
+
+          mid    = lo + (hi - lo) / 2;
+          suffix = &g_array_index (index->suffixes, Suffix, mid);
+          if (strcmp (index->tokens[suffix->token] + suffix->offset, token) < 0)
+            lo = mid + 1;
+          else
+            hi = mid;
+        }
+
+      /* a token containing the query token more than once shows up more
+         than once here, which the counts shrug off */
+      for (guint i = lo; i < index->suffixes->len; i++)
+        {
+          Suffix *suffix = NULL;
+          guint32 start  = 0;
+          guint32 end    = 0;
+
+          suffix = &g_array_index (index->suffixes, Suffix, i);
+          if (strncmp (index->tokens[suffix->token] + suffix->offset, token, length) != 0)
+            break;
+
+          start = index->posting_starts[suffix->token];
+          end   = index->posting_starts[suffix->token + 1];
+          for (guint32 j = start; j < end; j++)
+            {
+              if (hits[index->postings[j]] == q)
+                {
+                  hits[index->postings[j]] = q + 1;
+                  n_present++;
+                }
+            }
+        }
+
+      if (n_present == 0)
+        return g_array_new (FALSE, FALSE, sizeof (guint));
+    }
+
+  candidates = g_array_new (FALSE, FALSE, sizeof (guint));
+  for (guint i = 0; i < n_entries; i++)
+    {
+      if (hits[i] == n_query)
+        g_array_append_val (candidates, i);
+    }
+
+  return g_steal_pointer (&candidates);
+}
+
+/* Whether entry `a_idx` of `a` has the same text as `b_idx` of `b` */
+static gboolean
+same_entry_text (CorpusData *a,
+                 guint       a_idx,
+                 CorpusData *b,
+                 guint       b_idx)
+{
+  for (guint i = 0; i < N_FIELDS; i++)
+    {
+      TokenColumn *a_column = NULL;
+      TokenColumn *b_column = NULL;
+      guint32      a_first  = 0;
+      guint32      a_last   = 0;
+      guint32      b_first  = 0;
+      guint32      b_last   = 0;
+      guint32      a_start  = 0;
+      guint32      b_start  = 0;
+      guint32      a_end    = 0;
+      guint32      b_end    = 0;
+
+      a_column = &a->fields[i];
+      b_column = &b->fields[i];
+
+      a_first = g_array_index (a_column->entry_tokens, guint32, a_idx);
+      a_last  = g_array_index (a_column->entry_tokens, guint32, a_idx + 1);
+      b_first = g_array_index (b_column->entry_tokens, guint32, b_idx);
+      b_last  = g_array_index (b_column->entry_tokens, guint32, b_idx + 1);
+      if (a_last - a_first != b_last - b_first)
+        return FALSE;
+      if (a_first == a_last)
+        continue;
+
+      /* the tokens sit back to back, so comparing the runs is enough */
+      a_start = g_array_index (a_column->token_offsets, guint32, a_first);
+      b_start = g_array_index (b_column->token_offsets, guint32, b_first);
+      a_end   = g_array_index (a_column->token_offsets, guint32, a_last - 1) +
+              g_array_index (a_column->token_bytes, guint32, a_last - 1);
+      b_end   = g_array_index (b_column->token_offsets, guint32, b_last - 1) +
+              g_array_index (b_column->token_bytes, guint32, b_last - 1);
+      if (a_end - a_start != b_end - b_start ||
+          memcmp (a_column->arena->data + a_start,
+                  b_column->arena->data + b_start,
+                  a_end - a_start) != 0)
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* `seed`, plus what can score without matching the text: an exact app id
+ * and the apps the active biases boost */
+static GArray *
+collect_candidates (CorpusData *corpus,
+                    GArray     *seed,
+                    const char *query_utf8,
+                    GPtrArray  *active_biases)
 {
-  double score                = 0.0;
-  gsize  query_tok_utf8_len   = 0;
-  gsize  against_tok_utf8_len = 0;
+  g_autoptr (GArray) candidates = NULL;
+  gpointer idx_ptr              = NULL;
+  guint    kept                 = 0;
 
-  UTF8_FOREACH_TOKEN_FORWARDS (query_tok_start, query_tok_end, query, &query_tok_utf8_len)
-  {
-    gboolean query_token_has_match = FALSE;
+  candidates = g_array_sized_new (FALSE, FALSE, sizeof (guint), seed->len + 1);
+  g_array_append_vals (candidates, seed->data, seed->len);
+
+  if (g_hash_table_lookup_extended (corpus->id_to_idx, query_utf8, NULL, &idx_ptr))
+    {
+      guint idx = 0;
+
+      idx = GPOINTER_TO_UINT (idx_ptr);
+      g_array_append_val (candidates, idx);
+    }
 
-    UTF8_FOREACH_TOKEN_FORWARDS (against_tok_start, against_tok_end, against, &against_tok_utf8_len)
+  for (guint i = 0; i < active_biases->len; i++)
     {
-      gboolean match    = FALSE;
-      gsize    consumed = 0;
+      BiasData      *bias  = NULL;
+      GHashTableIter iter  = { 0 };
+      gpointer       appid = NULL;
 
-      if (accept_min_size > 0 &&
-          against_tok_utf8_len < accept_min_size)
+      bias = g_ptr_array_index (active_biases, i);
+      if (bias->boost == NULL)
         continue;
 
-      UTF8_FOREACH_FORWARD_WITH_END (against_ptr, against_tok_start, against_tok_end)
-      {
-        const char *against_check_ptr = NULL;
-        gunichar    against_ch        = 0;
+      g_hash_table_iter_init (&iter, bias->boost);
+      while (g_hash_table_iter_next (&iter, &appid, NULL))
+        {
+          if (g_hash_table_lookup_extended (corpus->id_to_idx, appid, NULL, &idx_ptr))
+            {
+              guint idx = 0;
 
-        if (query_tok_utf8_len > against_tok_utf8_len - consumed)
-          break;
+              idx = GPOINTER_TO_UINT (idx_ptr);
+              g_array_append_val (candidates, idx);
+            }
+        }
+    }
+
+  /* keep them in corpus order, without duplicates */
+  g_array_sort (candidates, cmp_guint);
+  for (guint i = 0; i < candidates->len; i++)
+    {
+      if (kept > 0 &&
+          g_array_index (candidates, guint, i) == g_array_index (candidates, guint, kept - 1))
+        continue;
+      g_array_index (candidates, guint, kept++) = g_array_index (candidates, guint, i);
+    }
+  g_array_set_size (candidates, kept);
+
+  return g_steal_pointer (&candidates);
+}
+
+/* Prepares the tokens of `query` that are long enough to tolerate typos:
+ * one edit up to seven characters and two from then on. Tokens longer than
+ * a machine word stay exact. */
+static FuzzyPattern *
+build_fuzzy_patterns (const TokenColumn *query)
+{
+  FuzzyPattern *patterns = NULL;
+  guint         n_query  = 0;
+
+  n_query  = query->token_offsets->len;
+  patterns = g_new0 (FuzzyPattern, MAX (1, n_query));
+
+  for (guint q = 0; q < n_query; q++)
+    {
+      const guchar *token = NULL;
+      guint         bytes = 0;
+      guint         chars = 0;
+
+      token = query->arena->data + g_array_index (query->token_offsets, guint32, q);
+      bytes = g_array_index (query->token_bytes, guint32, q);
+      chars = g_array_index (query->token_chars, guint32, q);
+      if (chars < FUZZY_MIN_CHARS || bytes > 64)
+        continue;
+
+      for (guint i = 0; i < bytes; i++)
+        patterns[q].peq[token[i]] |= G_GUINT64_CONSTANT (1) << i;
+      patterns[q].length       = bytes;
+      patterns[q].max_distance = chars >= 8 ? 2 : 1;
+    }
+
+  return patterns;
+}
+
+/* Every token of `query` has to occur inside some token of entry
+ * `against_idx`, and each token it occurs in adds to the score in
+ * proportion to how much of the token it covers. Both sides are lowercased
+ * valid UTF-8, so a byte match is a character match.
+ *
+ * With `patterns`, a query token that has an edit budget may instead come
+ * within that many edits of a substring of a token, each edit halving what
+ * it adds. Edits count bytes, so a typo on a character outside ASCII costs
+ * more than one. */
+static double
+test_strings (const TokenColumn  *query,
+              const FuzzyPattern *patterns,
+              const TokenColumn  *against,
+              guint               against_idx,
+              gssize              accept_min_size)
+{
+  const char    *query_arena   = NULL;
+  const guint32 *query_offsets = NULL;
+  const guint32 *query_bytes   = NULL;
+  const guint32 *query_chars   = NULL;
+  guint          n_query       = 0;
+  const char    *arena         = NULL;
+  const guint32 *offsets       = NULL;
+  const guint32 *bytes         = NULL;
+  const guint32 *chars         = NULL;
+  guint          first         = 0;
+  guint          last          = 0;
+  const char    *run           = NULL;
+  const char    *run_end       = NULL;
+  double         score         = 0.0;
+
+  query_arena   = (const char *) query->arena->data;
+  query_offsets = (const guint32 *) query->token_offsets->data;
+  query_bytes   = (const guint32 *) query->token_bytes->data;
+  query_chars   = (const guint32 *) query->token_chars->data;
+  n_query       = query->token_offsets->len;
+
+  arena   = (const char *) against->arena->data;
+  offsets = (const guint32 *) against->token_offsets->data;
+  bytes   = (const guint32 *) against->token_bytes->data;
+  chars   = (const guint32 *) against->token_chars->data;
+  first   = g_array_index (against->entry_tokens, guint32, against_idx);
+  last    = g_array_index (against->entry_tokens, guint32, against_idx + 1);
+
+  if (n_query == 0 || first == last)
+    return 0.0;
+
+  /* The entry's tokens sit back to back with a NUL between each, and no
+     query token contains a NUL, so the whole run can be searched in one go
+     without a match ever straddling two tokens */
+  run     = arena + offsets[first];
+  run_end = arena + offsets[last - 1] + bytes[last - 1];
+
+  for (guint q = 0; q < n_query; q++)
+    {
+      const char *query_tok             = NULL;
+      const char *from                  = NULL;
+      guint       t                     = 0;
+      gboolean    query_token_has_match = FALSE;
 
-        match = TRUE;
+      query_tok = query_arena + query_offsets[q];
+      from      = run;
+      t         = first;
+
+      if (patterns != NULL &&
+          patterns[q].max_distance > 0)
+        {
+          if (!test_token_fuzzy (
+                  &patterns[q], query_chars[q],
+                  run, run_end, chars + first,
+                  accept_min_size, &score))
+            return 0.0;
+          continue;
+        }
 
-        against_check_ptr = against_ptr;
-        against_ch        = g_unichar_tolower (g_utf8_get_char (against_ptr));
-        UTF8_FOREACH_FORWARD_WITH_END (query_ptr, query_tok_start, query_tok_end)
+      for (;;)
         {
-          gunichar query_ch = 0;
+          const char *found = NULL;
 
-          query_ch = g_unichar_tolower (g_utf8_get_char (query_ptr));
-          if (against_ch != query_ch)
+          found = find_bytes (from, run_end - from, query_tok, query_bytes[q]);
+          if (found == NULL)
+            break;
+
+          while (arena + offsets[t] + bytes[t] <= found)
+            t++;
+
+          if (accept_min_size <= 0 ||
+              chars[t] >= accept_min_size)
             {
-              match = FALSE;
-              break;
+              score += (double) (query_chars[q] * query_chars[q]) / (double) chars[t];
+              query_token_has_match = TRUE;
             }
 
-          against_check_ptr = g_utf8_next_char (against_check_ptr);
-          against_ch        = g_unichar_tolower (g_utf8_get_char (against_check_ptr));
+          /* a token counts once, however often it contains the query */
+          if (++t >= last)
+            break;
+          from = arena + offsets[t];
         }
 
-        if (match)
-          break;
-        else
-          consumed++;
-      }
+      if (!query_token_has_match)
+        return 0.0;
+    }
+
+  return score;
+}
+
+/* Myers' bit-parallel edit distance, searching for `pattern` anywhere in
+ * each of the NUL separated tokens of [`run`, `run_end`]; `chars` starts at
+ * the first token's. Returns whether some token came close enough. */
+static gboolean
+test_token_fuzzy (const FuzzyPattern *pattern,
+                  guint32             pattern_chars,
+                  const char         *run,
+                  const char         *run_end,
+                  const guint32      *chars,
+                  gssize              accept_min_size,
+                  double             *score)
+{
+  guint64  last_bit  = 0;
+  guint64  pv        = 0;
+  guint64  mv        = 0;
+  guint    distance  = 0;
+  guint    best      = 0;
+  guint    t         = 0;
+  gboolean has_match = FALSE;
+
+  last_bit = G_GUINT64_CONSTANT (1) << (pattern->length - 1);
+  pv       = G_MAXUINT64;
+  distance = pattern->length;
+  best     = pattern->length;
+
+  /* `run_end` is the NUL after the last token */
+  for (const char *p = run; p <= run_end; p++)
+    {
+      guint64 eq = 0;
+      guint64 xv = 0;
+      guint64 xh = 0;
+      guint64 ph = 0;
+      guint64 mh = 0;
 
-      if (match)
+      if (*p == '\0')
         {
-          score += (double) (query_tok_utf8_len * query_tok_utf8_len) / (double) against_tok_utf8_len;
-          query_token_has_match = TRUE;
+          if (best <= pattern->max_distance &&
+              (accept_min_size <= 0 || chars[t] >= accept_min_size))
+            {
+              *score += (double) (pattern_chars * pattern_chars) / (double) chars[t] /
+                        (double) (1u << best);
+              has_match = TRUE;
+            }
+
+          /* a match may start anywhere in the next token */
+          pv       = G_MAXUINT64;
+          mv       = 0;
+          distance = pattern->length;
+          best     = pattern->length;
+          t++;
+          continue;
         }
+
+      eq = pattern->peq[(guchar) *p];
+      xv = eq | mv;
+      xh = (((eq & pv) + pv) ^ pv) | eq;
+      ph = mv | ~(xh | pv);
+      mh = pv & xh;
+
+      if (ph & last_bit)
+        distance++;
+      else if (mh & last_bit)
+        distance--;
+      best = MIN (best, distance);
+
+      /* the first row stays zero, since a match can start anywhere */
+      ph <<= 1;
+      mh <<= 1;
+      pv = mh | ~(xv | ph);
+      mv = ph & xv;
     }
 
-    if (!query_token_has_match)
-      {
-        score = 0.0;
-        break;
-      }
-  }
+  return has_match;
+}
 
-  return score;
+static const char *
+find_bytes_scalar (const char *haystack,
+                   gsize       haystack_len,
+                   const char *needle,
+                   gsize       needle_len)
+{
+  const char *p   = NULL;
+  const char *end = NULL;
+
+  if (needle_len == 0)
+    return haystack;
+  if (needle_len > haystack_len)
+    return NULL;
+
+  p   = haystack;
+  end = haystack + haystack_len - needle_len + 1;
+  while (p < end)
+    {
+      p = memchr (p, needle[0], end - p);
+      if (p == NULL)
+        return NULL;
+
+      if (memcmp (p + 1, needle + 1, needle_len - 1) == 0)
+        return p;
+      p++;
+    }
+
+  return NULL;
 }
 
-static inline GUnicodeType
-utf8_char_class (const char *s,
-                 gunichar   *ch_out)
+#ifdef HAVE_X86_FIND_KERNELS
+
+/* These compare a whole block of positions against the first and the last
+ * byte of the needle at once, and only check the bytes in between where
+ * both agree. Whatever is left at the end goes to the scalar version. */
+
+__attribute__ ((target ("sse2")))
+static const char *
+find_bytes_sse2 (const char *haystack,
+                 gsize       haystack_len,
+                 const char *needle,
+                 gsize       needle_len)
 {
-  gunichar     ch = 0;
-  GUnicodeType cl = 0;
+  __m128i first = { 0 };
+  __m128i last  = { 0 };
+  gsize   i     = 0;
+
+  if (needle_len == 0)
+    return haystack;
+  if (needle_len > haystack_len)
+    return NULL;
+
+  first = _mm_set1_epi8 (needle[0]);
+  last  = _mm_set1_epi8 (needle[needle_len - 1]);
+
+  for (; i + needle_len - 1 + 16 <= haystack_len; i += 16)
+    {
+      __m128i block_first = { 0 };
+      __m128i block_last  = { 0 };
+      guint   mask        = 0;
+
+      block_first = _mm_loadu_si128 ((const __m128i *) (haystack + i));
+      block_last  = _mm_loadu_si128 ((const __m128i *) (haystack + i + needle_len - 1));
+      mask        = (guint) _mm_movemask_epi8 (
+          _mm_and_si128 (
+              _mm_cmpeq_epi8 (first, block_first),
+              _mm_cmpeq_epi8 (last, block_last)));
+
+      while (mask != 0)
+        {
+          guint bit = 0;
 
-  ch = g_utf8_get_char (s);
-  cl = g_unichar_type (ch);
+          bit = (guint) __builtin_ctz (mask);
+          if (needle_len <= 2 ||
+              memcmp (haystack + i + bit + 1, needle + 1, needle_len - 2) == 0)
+            return haystack + i + bit;
+          mask &= mask - 1;
+        }
+    }
 
-  if (ch_out != NULL)
-    *ch_out = ch;
-  return cl;
+  return find_bytes_scalar (haystack + i, haystack_len - i, needle, needle_len);
 }
 
-static inline const char *
-utf8_skip_to_next_of_class (const char **s,
-                            GUnicodeType class,
-                            gsize       *read_utf8)
+__attribute__ ((target ("avx2")))
+static const char *
+find_bytes_avx2 (const char *haystack,
+                 gsize       haystack_len,
+                 const char *needle,
+                 gsize       needle_len)
 {
-  gboolean skipped = FALSE;
+  __m256i first = { 0 };
+  __m256i last  = { 0 };
+  gsize   i     = 0;
 
-  if (read_utf8 != NULL)
-    *read_utf8 = 0;
+  if (needle_len == 0)
+    return haystack;
+  if (needle_len > haystack_len)
+    return NULL;
 
-  UTF8_FOREACH_FORWARD (p, *s)
-  {
-    if (utf8_char_class (p, NULL) == class)
-      {
-        if (skipped)
-          return p;
-      }
-    else
-      {
-        if (!skipped)
-          {
-            *s      = p;
-            skipped = TRUE;
-          }
-        if (read_utf8 != NULL)
-          (*read_utf8)++;
-      }
-  }
-  /* return the end of the string if nothing was found */
-  return *s + strlen (*s);
+  /* short runs are over before the wider blocks pay off */
+  if (haystack_len < 128)
+    return find_bytes_sse2 (haystack, haystack_len, needle, needle_len);
+
+  first = _mm256_set1_epi8 (needle[0]);
+  last  = _mm256_set1_epi8 (needle[needle_len - 1]);
+
+  for (; i + needle_len - 1 + 32 <= haystack_len; i += 32)
+    {
+      __m256i block_first = { 0 };
+      __m256i block_last  = { 0 };
+      guint32 mask        = 0;
+
+      block_first = _mm256_loadu_si256 ((const __m256i *) (haystack + i));
+      block_last  = _mm256_loadu_si256 ((const __m256i *) (haystack + i + needle_len - 1));
+      mask        = (guint32) _mm256_movemask_epi8 (
+          _mm256_and_si256 (
+              _mm256_cmpeq_epi8 (first, block_first),
+              _mm256_cmpeq_epi8 (last, block_last)));
+
+      while (mask != 0)
+        {
+          guint bit = 0;
+
+          bit = (guint) __builtin_ctz (mask);
+          if (needle_len <= 2 ||
+              memcmp (haystack + i + bit + 1, needle + 1, needle_len - 2) == 0)
+            return haystack + i + bit;
+          mask &= mask - 1;
+        }
+    }
+
+  /* the SSE2 version can still take a 16 byte block off the rest */
+  return find_bytes_sse2 (haystack + i, haystack_len - i, needle, needle_len);
 }
 
+#endif
+
+/* Best first, and in corpus order among equal scores, which is where a
+ * stable sort of the scores as they were gathered would put them */
 static gint
 cmp_scores (Score *a,
             Score *b)
 {
-  return (b->val - a->val < 0.0) ? -1 : 1;
+  if (a->val != b->val)
+    return (a->val < b->val) - (a->val > b->val);
+  return (a->idx > b->idx) - (a->idx < b->idx);
+}
+
+static gint
+cmp_suffixes (const Suffix *a,
+              const Suffix *b,
+              const char  **tokens)
+{
+  return strcmp (tokens[a->token] + a->offset, tokens[b->token] + b->offset);
+}
+
+static gint
+cmp_guint (gconstpointer a,
+           gconstpointer b)
+{
+  guint ua = *(const guint *) a;
+  guint ub = *(const guint *) b;
+
+  return (ua > ub) - (ua < ub);
 }
 
 /* End of bz-search-engine.c */
@@ -45,6 +45,16 @@ void
 bz_search_engine_set_biases (BzSearchEngine *self,
                              GListModel     *biases);
 
+gboolean
+bz_search_engine_get_fuzzy (BzSearchEngine *self);
+
+void
+bz_search_engine_set_fuzzy (BzSearchEngine *self,
+                            gboolean        fuzzy);
+
+GListModel *
+bz_search_engine_get_recent_queries (BzSearchEngine *self);
+
 DexFuture *
 bz_search_engine_query (BzSearchEngine    *self,
                         const char *const *terms);
@@ -0,0 +1,362 @@
+/* bz-search-results.c
+ *
+ * Copyright 2025 Adam Masciola
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#define G_LOG_DOMAIN "BAZAAR::SEARCH-RESULTS"
+
+#include "bz-search-results.h"
+#include "bz-search-result.h"
+#include "util.h"
+
+/* enough to cover what a grid view shows at once, plus some scrolling */
+#define CACHE_SIZE 128
+
+/* A list of BzSearchResult backed by plain arrays. Item `i` is group
+ * `indices[i]` with score `scores[i]`; the objects themselves are only
+ * created once somebody asks for them, and only the most recent ones are
+ * kept around. A filtered list also records where each of its items sits
+ * in the list it was made from, so it can follow changes there. */
+struct _BzSearchResults
+{
+  GObject parent_instance;
+
+  GPtrArray   *groups;
+  GArray      *indices;
+  GArray      *scores;
+  BzStateInfo *state;
+
+  GArray                   *source_positions;
+  BzSearchResultsFilterFunc filter_func;
+  gpointer                  filter_data;
+  GDestroyNotify            filter_destroy;
+
+  BzSearchResult *cache[CACHE_SIZE];
+  guint           cache_positions[CACHE_SIZE];
+};
+
+static void list_model_iface_init (GListModelInterface *iface);
+
+G_DEFINE_FINAL_TYPE_WITH_CODE (
+    BzSearchResults,
+    bz_search_results,
+    G_TYPE_OBJECT,
+    G_IMPLEMENT_INTERFACE (G_TYPE_LIST_MODEL, list_model_iface_init))
+
+static void
+source_items_changed (BzSearchResults *self,
+                      guint            position,
+                      guint            removed,
+                      guint            added,
+                      BzSearchResults *source);
+
+static void
+append_filtered (BzSearchResults *self,
+                 BzSearchResults *source,
+                 guint            from);
+
+static void
+clear_cache (BzSearchResults *self,
+             guint            from);
+
+static void
+bz_search_results_dispose (GObject *object)
+{
+  BzSearchResults *self = BZ_SEARCH_RESULTS (object);
+
+  clear_cache (self, 0);
+  g_clear_pointer (&self->groups, g_ptr_array_unref);
+  g_clear_pointer (&self->indices, g_array_unref);
+  g_clear_pointer (&self->scores, g_array_unref);
+  g_clear_object (&self->state);
+
+  g_clear_pointer (&self->source_positions, g_array_unref);
+  if (self->filter_destroy != NULL)
+    g_clear_pointer (&self->filter_data, self->filter_destroy);
+
+  G_OBJECT_CLASS (bz_search_results_parent_class)->dispose (object);
+}
+
+static void
+bz_search_results_class_init (BzSearchResultsClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->dispose = bz_search_results_dispose;
+}
+
+static void
+bz_search_results_init (BzSearchResults *self)
+{
+}
+
+static GType
+list_model_get_item_type (GListModel *list)
+{
+  return BZ_TYPE_SEARCH_RESULT;
+}
+
+static guint
+list_model_get_n_items (GListModel *list)
+{
+  BzSearchResults *self = BZ_SEARCH_RESULTS (list);
+
+  if (self->indices != NULL)
+    return self->indices->len;
+  else if (self->groups != NULL)
+    return self->groups->len;
+  else
+    return 0;
+}
+
+static gpointer
+list_model_get_item (GListModel *list,
+                     guint       position)
+{
+  BzSearchResults *self             = BZ_SEARCH_RESULTS (list);
+  guint            slot             = 0;
+  guint            idx              = 0;
+  g_autoptr (BzSearchResult) result = NULL;
+
+  if (position >= list_model_get_n_items (list))
+    return NULL;
+
+  slot = position % CACHE_SIZE;
+  if (self->cache[slot] != NULL &&
+      self->cache_positions[slot] == position)
+    return g_object_ref (self->cache[slot]);
+
+  idx = self->indices != NULL
+            ? g_array_index (self->indices, guint, position)
+            : position;
+
+  result = bz_search_result_new ();
+  bz_search_result_set_group (result, g_ptr_array_index (self->groups, idx));
+  bz_search_result_set_original_index (result, idx);
+  if (self->scores != NULL)
+    bz_search_result_set_score (result, g_array_index (self->scores, double, position));
+  if (self->state != NULL)
+    bz_search_result_set_state (result, self->state);
+
+  g_set_object (&self->cache[slot], result);
+  self->cache_positions[slot] = position;
+
+  return g_steal_pointer (&result);
+}
+
+static void
+list_model_iface_init (GListModelInterface *iface)
+{
+  iface->get_item_type = list_model_get_item_type;
+  iface->get_n_items   = list_model_get_n_items;
+  iface->get_item      = list_model_get_item;
+}
+
+/* `groups` is not copied and must not change afterwards. `indices` picks
+ * the groups in order, or every one when NULL, and `scores` runs parallel
+ * to it when given. Both arrays are kept rather than copied, and
+ * bz_search_results_replace_tail () changes them in place. Passing NULL for
+ * everything makes an empty list. */
+BzSearchResults *
+bz_search_results_new (GPtrArray *groups,
+                       GArray    *indices,
+                       GArray    *scores)
+{
+  BzSearchResults *self = NULL;
+
+  g_return_val_if_fail (groups != NULL || indices == NULL, NULL);
+  g_return_val_if_fail (scores == NULL ||
+                            (indices != NULL ? indices->len : groups->len) == scores->len,
+                        NULL);
+
+  self          = g_object_new (BZ_TYPE_SEARCH_RESULTS, NULL);
+  self->groups  = bz_maybe_ref (groups, g_ptr_array_ref);
+  self->indices = bz_maybe_ref (indices, g_array_ref);
+  self->scores  = bz_maybe_ref (scores, g_array_ref);
+
+  return self;
+}
+
+/* Returns the results whose group `func` accepts, in the same order. The
+ * filtered list keeps following this one, for which `user_data` is kept
+ * until the filtered list is gone. */
+BzSearchResults *
+bz_search_results_filter (BzSearchResults          *self,
+                          BzSearchResultsFilterFunc func,
+                          gpointer                  user_data,
+                          GDestroyNotify            destroy)
+{
+  g_autoptr (GArray) indices = NULL;
+  g_autoptr (GArray) scores  = NULL;
+  BzSearchResults *filtered  = NULL;
+
+  g_return_val_if_fail (BZ_IS_SEARCH_RESULTS (self), NULL);
+  g_return_val_if_fail (func != NULL, NULL);
+
+  if (self->groups == NULL)
+    {
+      if (destroy != NULL)
+        destroy (user_data);
+      return bz_search_results_new (NULL, NULL, NULL);
+    }
+
+  indices = g_array_new (FALSE, FALSE, sizeof (guint));
+  if (self->scores != NULL)
+    scores = g_array_new (FALSE, FALSE, sizeof (double));
+
+  filtered                   = bz_search_results_new (self->groups, indices, scores);
+  filtered->source_positions = g_array_new (FALSE, FALSE, sizeof (guint));
+  filtered->filter_func      = func;
+  filtered->filter_data      = user_data;
+  filtered->filter_destroy   = destroy;
+  append_filtered (filtered, self, 0);
+
+  if (self->state != NULL)
+    bz_search_results_set_state (filtered, self->state);
+
+  g_signal_connect_object (
+      self, "items-changed",
+      G_CALLBACK (source_items_changed),
+      filtered, G_CONNECT_SWAPPED);
+
+  return filtered;
+}
+
+/* Replaces every item from `position` on with `indices` and `scores`, the
+ * latter of which has to be given exactly when the list has scores */
+void
+bz_search_results_replace_tail (BzSearchResults *self,
+                                guint            position,
+                                GArray          *indices,
+                                GArray          *scores)
+{
+  guint old_length = 0;
+
+  g_return_if_fail (BZ_IS_SEARCH_RESULTS (self));
+  g_return_if_fail (self->indices != NULL);
+  g_return_if_fail (position <= self->indices->len);
+  g_return_if_fail (indices != NULL);
+  g_return_if_fail ((scores != NULL) == (self->scores != NULL));
+  g_return_if_fail (scores == NULL || scores->len == indices->len);
+
+  old_length = self->indices->len;
+
+  g_array_set_size (self->indices, position);
+  g_array_append_vals (self->indices, indices->data, indices->len);
+  if (scores != NULL)
+    {
+      g_array_set_size (self->scores, position);
+      g_array_append_vals (self->scores, scores->data, scores->len);
+    }
+  clear_cache (self, position);
+
+  g_list_model_items_changed (
+      G_LIST_MODEL (self), position,
+      old_length - position, indices->len);
+}
+
+/* Only used in debug mode, so the results can link back to the inspector */
+void
+bz_search_results_set_state (BzSearchResults *self,
+                             BzStateInfo     *state)
+{
+  g_return_if_fail (BZ_IS_SEARCH_RESULTS (self));
+  g_return_if_fail (state == NULL || BZ_IS_STATE_INFO (state));
+
+  if (g_set_object (&self->state, state))
+    clear_cache (self, 0);
+}
+
+/* The source only ever changes from some position to its end, so everything
+ * that came from there is filtered again */
+static void
+source_items_changed (BzSearchResults *self,
+                      guint            position,
+                      guint            removed,
+                      guint            added,
+                      BzSearchResults *source)
+{
+  guint old_length = 0;
+  guint first      = 0;
+  guint last       = 0;
+
+  old_length = self->indices->len;
+
+  last = self->source_positions->len;
+  while (first < last)
+    {
+      guint mid = 0;
+
+      mid = first + (last - first) / 2;
+      if (g_array_index (self->source_positions, guint, mid) < position)
+        first = mid + 1;
+      else
+        last = mid;
+    }
+
+  g_array_set_size (self->indices, first);
+  g_array_set_size (self->source_positions, first);
+  if (self->scores != NULL)
+    g_array_set_size (self->scores, first);
+  clear_cache (self, first);
+
+  append_filtered (self, source, position);
+
+  g_list_model_items_changed (
+      G_LIST_MODEL (self), first,
+      old_length - first, self->indices->len - first);
+}
+
+static void
+append_filtered (BzSearchResults *self,
+                 BzSearchResults *source,
+                 guint            from)
+{
+  guint n_items = 0;
+
+  n_items = list_model_get_n_items (G_LIST_MODEL (source));
+  for (guint i = from; i < n_items; i++)
+    {
+      guint idx = 0;
+
+      idx = source->indices != NULL
+                ? g_array_index (source->indices, guint, i)
+                : i;
+      if (!self->filter_func (g_ptr_array_index (source->groups, idx), self->filter_data))
+        continue;
+
+      g_array_append_val (self->indices, idx);
+      g_array_append_val (self->source_positions, i);
+      if (self->scores != NULL)
+        g_array_append_val (self->scores, g_array_index (source->scores, double, i));
+    }
+}
+
+static void
+clear_cache (BzSearchResults *self,
+             guint            from)
+{
+  for (guint i = 0; i < CACHE_SIZE; i++)
+    {
+      if (self->cache[i] != NULL &&
+          self->cache_positions[i] >= from)
+        g_clear_object (&self->cache[i]);
+    }
+}
+
+/* End of bz-search-results.c */
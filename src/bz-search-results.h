@@ -0,0 +1,59 @@
+/* bz-search-results.h
+ *
+ * Copyright 2025 Adam Masciola
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <gtk/gtk.h>
+
+#include "bz-entry-group.h"
+#include "bz-state-info.h"
+
+G_BEGIN_DECLS
+
+typedef gboolean (*BzSearchResultsFilterFunc) (BzEntryGroup *group,
+                                               gpointer      user_data);
+
+#define BZ_TYPE_SEARCH_RESULTS (bz_search_results_get_type ())
+G_DECLARE_FINAL_TYPE (BzSearchResults, bz_search_results, BZ, SEARCH_RESULTS, GObject)
+
+BzSearchResults *
+bz_search_results_new (GPtrArray *groups,
+                       GArray    *indices,
+                       GArray    *scores);
+
+BzSearchResults *
+bz_search_results_filter (BzSearchResults          *self,
+                          BzSearchResultsFilterFunc func,
+                          gpointer                  user_data,
+                          GDestroyNotify            destroy);
+
+void
+bz_search_results_replace_tail (BzSearchResults *self,
+                                guint            position,
+                                GArray          *indices,
+                                GArray          *scores);
+
+void
+bz_search_results_set_state (BzSearchResults *self,
+                             BzStateInfo     *state);
+
+G_END_DECLS
+
+/* End of bz-search-results.h */
@@ -0,0 +1,176 @@
+/* search-index-format.h
+ *
+ * Copyright 2026 Alexander Vanhee
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * On-disk layout of the search index, shared by the writer in the main
+ * application and the reader in bazaar-daemon. All integers are little
+ * endian.
+ *
+ * VERSION 1 (read only):
+ * char[4] "BZSI"
+ * uint32  version
+ * uint32  entry count
+ * then per entry: id, title, developer, description (cut off),
+ * search_tokens, icon_path, with strings as uint32 length + uint8[] bytes
+ *
+ * VERSION 2:
+ * SearchIndexHeader
+ * SearchIndexSection[n_sections]
+ * section payloads, each starting on a SEARCH_INDEX_ALIGNMENT boundary
+ *
+ * The file is meant to be mapped and read in place: records hold offsets
+ * into the string pool, which begins with a NUL byte (offset 0 is an absent
+ * field) and stores every string NUL terminated. Readers skip sections of
+ * unknown kind.
+ *
+ * The optional FOLDED section runs parallel to RECORDS and points at copies
+ * of the searchable fields (title, developer, description and search tokens)
+ * which have been NFKD decomposed, case folded and stripped of combining
+ * marks, so they can be matched byte for byte. Because readers have no
+ * Unicode tables of their own, the FOLDS section maps every code point that
+ * folds to something else, sorted by code point, to the pool string it folds
+ * to (offset 0 when it folds away entirely). It covers each code point found
+ * in the fields plus the common Latin, Greek, Cyrillic and fullwidth blocks,
+ * so a query character from those blocks, or one the catalog uses anywhere,
+ * folds exactly like the fields did. Code points absent from the table fold
+ * to themselves, ASCII letters to lowercase; an uppercase or accented query
+ * character outside of it therefore won't match its folded form in the
+ * fields.
+ *
+ * The optional TRIGRAMS section is a table of SearchIndexTrigram sorted by
+ * key, one for every three byte window of the searchable fields, taken from
+ * the folded copies when the index has them and otherwise after ASCII
+ * lowercasing. Each one names a run of POSTINGS, which are ascending uint32
+ * record indices.
+ *
+ * The optional DIGESTS section starts with the uint32
+ * SEARCH_INDEX_WRITER_REVISION of the writer that made the file, followed by
+ * SEARCH_INDEX_DIGEST_SIZE bytes per record, a hash of its fields. This lets
+ * the writer tell when the catalog it is about to write is already on disk,
+ * written the same way.
+ *
+ * The optional IDS section is an open addressing hash table from app id to
+ * record: a power of two number of uint32 slots holding record index + 1, or
+ * 0 when empty, probed linearly from search_index_id_hash() of the id.
+ */
+
+#define SEARCH_INDEX_MAGIC     "BZSI"
+#define SEARCH_INDEX_VERSION_1 1
+#define SEARCH_INDEX_VERSION_2 2
+#define SEARCH_INDEX_ALIGNMENT 8
+
+#define SEARCH_INDEX_DIGEST_SIZE 16
+
+/* Bump whenever the writer changes what it derives from the catalog, such
+ * as the folding, the trigrams or the set of sections, so files written
+ * before are not kept around as up to date */
+#define SEARCH_INDEX_WRITER_REVISION 1
+
+enum
+{
+  SEARCH_INDEX_SECTION_RECORDS  = 1,
+  SEARCH_INDEX_SECTION_STRINGS  = 2,
+  SEARCH_INDEX_SECTION_TRIGRAMS = 3,
+  SEARCH_INDEX_SECTION_POSTINGS = 4,
+  SEARCH_INDEX_SECTION_IDS      = 5,
+  SEARCH_INDEX_SECTION_FOLDED   = 6,
+  SEARCH_INDEX_SECTION_FOLDS    = 7,
+  SEARCH_INDEX_SECTION_DIGESTS  = 8,
+};
+
+typedef struct
+{
+  char     magic[4];
+  uint32_t version;
+  uint32_t n_entries;
+  uint32_t n_sections;
+} SearchIndexHeader;
+
+typedef struct
+{
+  uint32_t kind;
+  uint32_t offset;
+  uint32_t size;
+  uint32_t reserved;
+} SearchIndexSection;
+
+typedef struct
+{
+  uint32_t id;
+  uint32_t title;
+  uint32_t developer;
+  uint32_t description;
+  uint32_t search_tokens;
+  uint32_t icon_path;
+} SearchIndexRecord;
+
+typedef struct
+{
+  uint32_t title;
+  uint32_t developer;
+  uint32_t description;
+  uint32_t search_tokens;
+} SearchIndexFoldedRecord;
+
+typedef struct
+{
+  uint32_t codepoint;
+  uint32_t folded;
+} SearchIndexFold;
+
+typedef struct
+{
+  uint32_t key;
+  uint32_t first;
+  uint32_t count;
+} SearchIndexTrigram;
+
+static inline uint32_t
+search_index_trigram_key (const char *s)
+{
+  unsigned char a = (unsigned char) s[0];
+  unsigned char b = (unsigned char) s[1];
+  unsigned char c = (unsigned char) s[2];
+
+#define ASCII_LOWER(_c) ((_c) >= 'A' && (_c) <= 'Z' ? (_c) + ('a' - 'A') : (_c))
+  return ((uint32_t) ASCII_LOWER (a) << 16) |
+         ((uint32_t) ASCII_LOWER (b) << 8) |
+         (uint32_t) ASCII_LOWER (c);
+#undef ASCII_LOWER
+}
+
+/* 32 bit FNV-1a */
+static inline uint32_t
+search_index_id_hash (const char *id)
+{
+  uint32_t hash = 2166136261u;
+
+  for (; *id != '\0'; id++)
+    {
+      hash ^= (unsigned char) *id;
+      hash *= 16777619u;
+    }
+
+  return hash;
+}
@@ -24,13 +24,47 @@
 #define BAZAAR_MODULE "search-index-writer"
 
 #include "bz-entry-group.h"
+#include "search-index-format.h"
 #include "search-index-write.h"
 
-#define INDEX_MAGIC         "BZSI"
-#define INDEX_VERSION       1
 #define DESCRIPTION_MAX_LEN 200
 
-static gboolean    write_string (GDataOutputStream *out, const char *str, gsize max_len, GError **error);
+/* Blocks a search term is likely to be typed in, whose foldings are always
+ * written out so the daemon can fold terms the catalog itself never uses */
+static const struct
+{
+  gunichar first;
+  gunichar last;
+} fold_ranges[] = {
+  { 0x00C0, 0x024F }, /* Latin-1 Supplement, Latin Extended-A and B */
+  { 0x0300, 0x036F }, /* Combining Diacritical Marks */
+  { 0x0370, 0x03FF }, /* Greek */
+  { 0x0400, 0x04FF }, /* Cyrillic */
+  { 0x1E00, 0x1EFF }, /* Latin Extended Additional */
+  { 0xFF01, 0xFF5E }, /* Fullwidth ASCII */
+};
+
+typedef struct
+{
+  guint32       kind;
+  gconstpointer data;
+  gsize         size;
+} Section;
+
+static guint32     pool_add (GByteArray *pool, const char *str, gsize max_len);
+static void        pad_to_alignment (GByteArray *buffer);
+static const char *pool_peek (GByteArray *pool, guint32 offset);
+static void        add_digest (GByteArray *digests, GByteArray *pool, const SearchIndexRecord *record);
+static gboolean    index_is_current (const char *path, guint32 n_entries, GByteArray *digests);
+static guint32     pool_add_folded (GByteArray *pool, GHashTable *codepoints, guint32 offset);
+static char       *fold_string (const char *str);
+static void        collect_codepoints (GHashTable *codepoints, const char *str);
+static GArray     *build_fold_table (GHashTable *codepoints, GByteArray *pool);
+static void        collect_trigrams (GArray *keys, const char *str);
+static void        build_trigrams (GArray *folded, GByteArray *pool, GArray **trigrams_out, GArray **postings_out);
+static GArray     *build_id_table (GArray *records, GByteArray *pool);
+static gint        cmp_uint32 (gconstpointer a, gconstpointer b);
+static GByteArray *assemble_index (guint32 n_entries, const Section *sections, guint n_sections);
 static gboolean    entry_group_is_eligible (BzEntryGroup *group);
 static const char *entry_group_icon_path (BzEntryGroup *group);
 
@@ -39,99 +73,578 @@ bz_write_search_index (GListModel *groups,
                        const char *out_path,
                        GError    **error)
 {
-  g_autofree char *tmp_path          = NULL;
-  g_autoptr (GFile) tmp_file         = NULL;
-  g_autoptr (GFile) final_file       = NULL;
-  g_autoptr (GOutputStream) base_out = NULL;
-  g_autoptr (GDataOutputStream) out  = NULL;
-  guint    n_groups                  = 0;
-  guint32  count                     = 0;
-  gboolean result                    = FALSE;
+  g_autoptr (GArray) records        = NULL;
+  g_autoptr (GArray) folded         = NULL;
+  g_autoptr (GByteArray) pool       = NULL;
+  g_autoptr (GHashTable) codepoints = NULL;
+  g_autoptr (GArray) folds          = NULL;
+  g_autoptr (GArray) trigrams       = NULL;
+  g_autoptr (GArray) postings       = NULL;
+  g_autoptr (GArray) id_table       = NULL;
+  g_autoptr (GByteArray) digests    = NULL;
+  g_autoptr (GByteArray) buffer     = NULL;
+  guint   n_groups                  = 0;
+  guint32 revision                  = 0;
+  Section sections[8]               = { 0 };
 
   g_return_val_if_fail (G_IS_LIST_MODEL (groups), FALSE);
   g_return_val_if_fail (out_path != NULL, FALSE);
 
-  tmp_path = g_strdup_printf ("%s.tmp", out_path);
-  tmp_file = g_file_new_for_path (tmp_path);
+  records    = g_array_new (FALSE, TRUE, sizeof (SearchIndexRecord));
+  folded     = g_array_new (FALSE, TRUE, sizeof (SearchIndexFoldedRecord));
+  pool       = g_byte_array_new ();
+  codepoints = g_hash_table_new (g_direct_hash, g_direct_equal);
+  digests    = g_byte_array_new ();
 
-  base_out = G_OUTPUT_STREAM (g_file_replace (
-      tmp_file, NULL, FALSE,
-      G_FILE_CREATE_REPLACE_DESTINATION, NULL, error));
-  if (base_out == NULL)
-    return FALSE;
+  /* offset 0 is reserved for absent fields */
+  g_byte_array_append (pool, (const guint8 *) "", 1);
 
-  out = g_data_output_stream_new (base_out);
-  g_data_output_stream_set_byte_order (out, G_DATA_STREAM_BYTE_ORDER_LITTLE_ENDIAN);
-
-  if (!g_output_stream_write_all (G_OUTPUT_STREAM (out), INDEX_MAGIC, 4, NULL, NULL, error))
-    return FALSE;
-  if (!g_data_output_stream_put_uint32 (out, INDEX_VERSION, NULL, error))
-    return FALSE;
+  revision = GUINT32_TO_LE (SEARCH_INDEX_WRITER_REVISION);
+  g_byte_array_append (digests, (const guint8 *) &revision, sizeof (revision));
 
   n_groups = g_list_model_get_n_items (groups);
   for (guint i = 0; i < n_groups; i++)
     {
       g_autoptr (BzEntryGroup) group = g_list_model_get_item (groups, i);
-      if (entry_group_is_eligible (group))
-        count++;
+      SearchIndexRecord record       = { 0 };
+
+      if (!entry_group_is_eligible (group))
+        continue;
+
+      record.id            = pool_add (pool, bz_entry_group_get_id (group), 0);
+      record.title         = pool_add (pool, bz_entry_group_get_title (group), 0);
+      record.developer     = pool_add (pool, bz_entry_group_get_developer (group), 0);
+      record.description   = pool_add (pool, bz_entry_group_get_description (group), DESCRIPTION_MAX_LEN);
+      record.search_tokens = pool_add (pool, bz_entry_group_get_search_tokens (group), 0);
+      record.icon_path     = pool_add (pool, entry_group_icon_path (group), 0);
+
+      add_digest (digests, pool, &record);
+      g_array_append_val (records, record);
+    }
+
+  /* rewriting an identical index would only make every daemon reload it,
+   * and everything below only depends on the records and the writer */
+  if (index_is_current (out_path, records->len, digests))
+    {
+      g_debug ("Search index at %s is up to date, not rewriting it", out_path);
+      return TRUE;
+    }
+
+  for (guint i = 0; i < records->len; i++)
+    {
+      SearchIndexRecord      *record = NULL;
+      SearchIndexFoldedRecord fold   = { 0 };
+
+      record = &g_array_index (records, SearchIndexRecord, i);
+
+      /* folded from the pool so the description is cut off the same way */
+      fold.title         = pool_add_folded (pool, codepoints, record->title);
+      fold.developer     = pool_add_folded (pool, codepoints, record->developer);
+      fold.description   = pool_add_folded (pool, codepoints, record->description);
+      fold.search_tokens = pool_add_folded (pool, codepoints, record->search_tokens);
+
+      g_array_append_val (folded, fold);
+    }
+
+  folds = build_fold_table (codepoints, pool);
+  build_trigrams (folded, pool, &trigrams, &postings);
+  id_table = build_id_table (records, pool);
+
+  sections[0] = (Section) {
+    .kind = SEARCH_INDEX_SECTION_RECORDS,
+    .data = records->data,
+    .size = records->len * sizeof (SearchIndexRecord),
+  };
+  sections[1] = (Section) {
+    .kind = SEARCH_INDEX_SECTION_STRINGS,
+    .data = pool->data,
+    .size = pool->len,
+  };
+  sections[2] = (Section) {
+    .kind = SEARCH_INDEX_SECTION_TRIGRAMS,
+    .data = trigrams->data,
+    .size = trigrams->len * sizeof (SearchIndexTrigram),
+  };
+  sections[3] = (Section) {
+    .kind = SEARCH_INDEX_SECTION_POSTINGS,
+    .data = postings->data,
+    .size = postings->len * sizeof (guint32),
+  };
+  sections[4] = (Section) {
+    .kind = SEARCH_INDEX_SECTION_IDS,
+    .data = id_table->data,
+    .size = id_table->len * sizeof (guint32),
+  };
+  sections[5] = (Section) {
+    .kind = SEARCH_INDEX_SECTION_FOLDED,
+    .data = folded->data,
+    .size = folded->len * sizeof (SearchIndexFoldedRecord),
+  };
+  sections[6] = (Section) {
+    .kind = SEARCH_INDEX_SECTION_FOLDS,
+    .data = folds->data,
+    .size = folds->len * sizeof (SearchIndexFold),
+  };
+  sections[7] = (Section) {
+    .kind = SEARCH_INDEX_SECTION_DIGESTS,
+    .data = digests->data,
+    .size = digests->len,
+  };
+
+  buffer = assemble_index (records->len, sections, G_N_ELEMENTS (sections));
+
+  return g_file_set_contents_full (
+      out_path,
+      (const char *) buffer->data, buffer->len,
+      G_FILE_SET_CONTENTS_CONSISTENT,
+      0644, error);
+}
+
+static guint32
+pool_add (GByteArray *pool,
+          const char *str,
+          gsize       max_len)
+{
+  gsize   len    = 0;
+  guint32 offset = 0;
+
+  if (str == NULL || *str == '\0')
+    return 0;
+
+  len = strlen (str);
+  if (max_len > 0 && len > max_len)
+    {
+      len = max_len;
+      /* don't leave half a character behind */
+      while (len > 0 && (str[len] & 0xC0) == 0x80)
+        len--;
+    }
+
+  offset = pool->len;
+  g_byte_array_append (pool, (const guint8 *) str, len);
+  g_byte_array_append (pool, (const guint8 *) "", 1);
+
+  return GUINT32_TO_LE (offset);
+}
+
+static const char *
+pool_peek (GByteArray *pool,
+           guint32     offset)
+{
+  offset = GUINT32_FROM_LE (offset);
+  if (offset == 0)
+    return NULL;
+
+  return (const char *) pool->data + offset;
+}
+
+static void
+add_digest (GByteArray              *digests,
+            GByteArray              *pool,
+            const SearchIndexRecord *record)
+{
+  g_autoptr (GChecksum) checksum = NULL;
+  guint8  digest[32]             = { 0 };
+  gsize   digest_len             = sizeof (digest);
+  guint32 fields[]               = {
+    record->id,
+    record->title,
+    record->developer,
+    record->description,
+    record->search_tokens,
+    record->icon_path,
+  };
+
+  checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  for (guint i = 0; i < G_N_ELEMENTS (fields); i++)
+    {
+      const char *str = NULL;
+
+      str = pool_peek (pool, fields[i]);
+      if (str != NULL)
+        g_checksum_update (checksum, (const guchar *) str, strlen (str));
+
+      /* keep one field from running into the next */
+      g_checksum_update (checksum, (const guchar *) "", 1);
     }
 
-  if (!g_data_output_stream_put_uint32 (out, count, NULL, error))
+  g_checksum_get_digest (checksum, digest, &digest_len);
+  g_byte_array_append (digests, digest, SEARCH_INDEX_DIGEST_SIZE);
+}
+
+/* Whether the file at `path` was written by this revision of the writer
+ * from entries with the same digests */
+static gboolean
+index_is_current (const char *path,
+                  guint32     n_entries,
+                  GByteArray *digests)
+{
+  g_autoptr (GMappedFile) mapped   = NULL;
+  const char               *data   = NULL;
+  gsize                     size   = 0;
+  const SearchIndexHeader  *header = NULL;
+  const SearchIndexSection *table  = NULL;
+  guint32                   n      = 0;
+
+  mapped = g_mapped_file_new (path, FALSE, NULL);
+  if (mapped == NULL)
     return FALSE;
 
-  for (guint i = 0; i < n_groups; i++)
+  data = g_mapped_file_get_contents (mapped);
+  size = g_mapped_file_get_length (mapped);
+  if (data == NULL || size < sizeof (SearchIndexHeader))
+    return FALSE;
+
+  header = (const SearchIndexHeader *) data;
+  n      = GUINT32_FROM_LE (header->n_sections);
+  if (memcmp (header->magic, SEARCH_INDEX_MAGIC, 4) != 0 ||
+      GUINT32_FROM_LE (header->version) != SEARCH_INDEX_VERSION_2 ||
+      GUINT32_FROM_LE (header->n_entries) != n_entries ||
+      (size - sizeof (SearchIndexHeader)) / sizeof (SearchIndexSection) < n)
+    return FALSE;
+
+  table = (const SearchIndexSection *) (header + 1);
+  for (guint i = 0; i < n; i++)
     {
-      g_autoptr (BzEntryGroup) group = g_list_model_get_item (groups, i);
-      const char *icon_path          = NULL;
+      guint32 offset = 0;
+      guint32 len    = 0;
 
-      if (!entry_group_is_eligible (group))
+      if (GUINT32_FROM_LE (table[i].kind) != SEARCH_INDEX_SECTION_DIGESTS)
         continue;
 
-      icon_path = entry_group_icon_path (group);
+      /* the revision leads the digests, so this compares both */
+      offset = GUINT32_FROM_LE (table[i].offset);
+      len    = GUINT32_FROM_LE (table[i].size);
+      return offset <= size && len <= size - offset &&
+             len == digests->len &&
+             memcmp (data + offset, digests->data, len) == 0;
+    }
 
-      if (!write_string (out, bz_entry_group_get_id (group), 0, error) ||
-          !write_string (out, bz_entry_group_get_title (group), 0, error) ||
-          !write_string (out, bz_entry_group_get_developer (group), 0, error) ||
-          !write_string (out, bz_entry_group_get_description (group), DESCRIPTION_MAX_LEN, error) ||
-          !write_string (out, bz_entry_group_get_search_tokens (group), 0, error) ||
-          !write_string (out, icon_path, 0, error))
-        return FALSE;
+  return FALSE;
+}
+
+static guint32
+pool_add_folded (GByteArray *pool,
+                 GHashTable *codepoints,
+                 guint32     offset)
+{
+  g_autofree char *folded = NULL;
+
+  collect_codepoints (codepoints, pool_peek (pool, offset));
+
+  /* the pool may move once appended to, so fold before adding */
+  folded = fold_string (pool_peek (pool, offset));
+  return pool_add (pool, folded, 0);
+}
+
+/* NFKD, then case fold, then drop the combining marks the decomposition
+ * split off, so "Écrire" becomes "ecrire". Each step works a code point at
+ * a time, which is what lets the daemon fold terms from the FOLDS table. */
+static char *
+fold_string (const char *str)
+{
+  g_autofree char *valid      = NULL;
+  g_autofree char *decomposed = NULL;
+  g_autofree char *casefolded = NULL;
+  GString         *folded     = NULL;
+
+  if (str == NULL)
+    return NULL;
+
+  valid      = g_utf8_make_valid (str, -1);
+  decomposed = g_utf8_normalize (valid, -1, G_NORMALIZE_NFKD);
+  casefolded = g_utf8_casefold (decomposed, -1);
+
+  folded = g_string_sized_new (strlen (casefolded));
+  for (const char *p = casefolded; *p != '\0'; p = g_utf8_next_char (p))
+    {
+      gunichar ch = 0;
+
+      ch = g_utf8_get_char (p);
+      if (!g_unichar_ismark (ch))
+        g_string_append_unichar (folded, ch);
     }
 
-  if (!g_output_stream_close (G_OUTPUT_STREAM (out), NULL, error))
-    return FALSE;
+  return g_string_free (folded, FALSE);
+}
+
+static void
+collect_codepoints (GHashTable *codepoints,
+                    const char *str)
+{
+  if (str == NULL)
+    return;
+
+  for (const char *p = str; *p != '\0'; p = g_utf8_next_char (p))
+    {
+      gunichar ch = 0;
 
-  final_file = g_file_new_for_path (out_path);
-  result     = g_file_move (
-      tmp_file, final_file,
-      G_FILE_COPY_OVERWRITE,
-      NULL, NULL, NULL, error);
+      if ((guchar) *p < 0x80)
+        continue;
 
-  return result;
+      ch = g_utf8_get_char_validated (p, -1);
+      if (ch != (gunichar) -1 && ch != (gunichar) -2)
+        g_hash_table_add (codepoints, GUINT_TO_POINTER (ch));
+    }
 }
 
-static gboolean
-write_string (GDataOutputStream *out,
-              const char        *str,
-              gsize              max_len,
-              GError           **error)
+static GArray *
+build_fold_table (GHashTable *codepoints,
+                  GByteArray *pool)
+{
+  g_autoptr (GArray) sorted = NULL;
+  g_autoptr (GArray) folds  = NULL;
+  GHashTableIter iter       = { 0 };
+  gpointer       key_ptr    = NULL;
+
+  for (guint i = 0; i < G_N_ELEMENTS (fold_ranges); i++)
+    {
+      for (gunichar ch = fold_ranges[i].first; ch <= fold_ranges[i].last; ch++)
+        g_hash_table_add (codepoints, GUINT_TO_POINTER (ch));
+    }
+
+  sorted = g_array_sized_new (FALSE, FALSE, sizeof (guint32), g_hash_table_size (codepoints));
+  g_hash_table_iter_init (&iter, codepoints);
+  while (g_hash_table_iter_next (&iter, &key_ptr, NULL))
+    {
+      guint32 ch = 0;
+
+      ch = GPOINTER_TO_UINT (key_ptr);
+      g_array_append_val (sorted, ch);
+    }
+  g_array_sort (sorted, cmp_uint32);
+
+  folds = g_array_new (FALSE, TRUE, sizeof (SearchIndexFold));
+  for (guint i = 0; i < sorted->len; i++)
+    {
+      g_autofree char *folded  = NULL;
+      char             utf8[8] = { 0 };
+      SearchIndexFold  fold    = { 0 };
+
+      g_unichar_to_utf8 (g_array_index (sorted, guint32, i), utf8);
+
+      folded = fold_string (utf8);
+      if (g_strcmp0 (folded, utf8) == 0)
+        continue;
+
+      fold.codepoint = GUINT32_TO_LE (g_array_index (sorted, guint32, i));
+      fold.folded    = pool_add (pool, folded, 0);
+      g_array_append_val (folds, fold);
+    }
+
+  return g_steal_pointer (&folds);
+}
+
+static void
+collect_trigrams (GArray     *keys,
+                  const char *str)
 {
   gsize len = 0;
 
-  if (str != NULL)
+  if (str == NULL)
+    return;
+
+  len = strlen (str);
+  for (gsize i = 0; i + 2 < len; i++)
     {
-      len = strlen (str);
-      if (max_len > 0 && len > max_len)
-        len = max_len;
+      guint32 key = 0;
+
+      key = search_index_trigram_key (str + i);
+      g_array_append_val (keys, key);
     }
+}
 
-  if (!g_data_output_stream_put_uint32 (out, (guint32) len, NULL, error))
-    return FALSE;
+static void
+build_trigrams (GArray     *folded,
+                GByteArray *pool,
+                GArray    **trigrams_out,
+                GArray    **postings_out)
+{
+  g_autoptr (GHashTable) lists  = NULL;
+  g_autoptr (GArray) keys       = NULL;
+  g_autoptr (GArray) all_keys   = NULL;
+  g_autoptr (GArray) trigrams   = NULL;
+  g_autoptr (GArray) postings   = NULL;
+  GHashTableIter iter           = { 0 };
+  gpointer       key_ptr        = NULL;
+
+  lists = g_hash_table_new_full (
+      g_direct_hash, g_direct_equal,
+      NULL, (GDestroyNotify) g_array_unref);
+  keys = g_array_new (FALSE, FALSE, sizeof (guint32));
+
+  for (guint i = 0; i < folded->len; i++)
+    {
+      SearchIndexFoldedRecord *record = NULL;
+
+      record = &g_array_index (folded, SearchIndexFoldedRecord, i);
+
+      g_array_set_size (keys, 0);
+      collect_trigrams (keys, pool_peek (pool, record->title));
+      collect_trigrams (keys, pool_peek (pool, record->developer));
+      collect_trigrams (keys, pool_peek (pool, record->description));
+      collect_trigrams (keys, pool_peek (pool, record->search_tokens));
+      g_array_sort (keys, cmp_uint32);
+
+      for (guint j = 0; j < keys->len; j++)
+        {
+          guint32 key  = 0;
+          GArray *list = NULL;
+
+          key = g_array_index (keys, guint32, j);
+          if (j > 0 && key == g_array_index (keys, guint32, j - 1))
+            continue;
+
+          /* keys never contain a NUL byte so they are never 0 */
+          list = g_hash_table_lookup (lists, GUINT_TO_POINTER (key));
+          if (list == NULL)
+            {
+              list = g_array_new (FALSE, FALSE, sizeof (guint32));
+              g_hash_table_replace (lists, GUINT_TO_POINTER (key), list);
+            }
+
+          /* records are visited in order, so every list stays sorted */
+          g_array_append_val (list, i);
+        }
+    }
+
+  all_keys = g_array_sized_new (FALSE, FALSE, sizeof (guint32), g_hash_table_size (lists));
+  g_hash_table_iter_init (&iter, lists);
+  while (g_hash_table_iter_next (&iter, &key_ptr, NULL))
+    {
+      guint32 key = 0;
+
+      key = GPOINTER_TO_UINT (key_ptr);
+      g_array_append_val (all_keys, key);
+    }
+  g_array_sort (all_keys, cmp_uint32);
+
+  trigrams = g_array_sized_new (FALSE, TRUE, sizeof (SearchIndexTrigram), all_keys->len);
+  postings = g_array_new (FALSE, FALSE, sizeof (guint32));
 
-  if (len > 0)
-    return g_output_stream_write_all (G_OUTPUT_STREAM (out), str, len, NULL, NULL, error);
+  for (guint i = 0; i < all_keys->len; i++)
+    {
+      guint32            key     = 0;
+      GArray            *list    = NULL;
+      SearchIndexTrigram trigram = { 0 };
+
+      key  = g_array_index (all_keys, guint32, i);
+      list = g_hash_table_lookup (lists, GUINT_TO_POINTER (key));
+
+      trigram.key   = GUINT32_TO_LE (key);
+      trigram.first = GUINT32_TO_LE (postings->len);
+      trigram.count = GUINT32_TO_LE (list->len);
+      g_array_append_val (trigrams, trigram);
+
+      for (guint j = 0; j < list->len; j++)
+        {
+          guint32 record_idx = 0;
+
+          record_idx = GUINT32_TO_LE (g_array_index (list, guint32, j));
+          g_array_append_val (postings, record_idx);
+        }
+    }
+
+  *trigrams_out = g_steal_pointer (&trigrams);
+  *postings_out = g_steal_pointer (&postings);
+}
+
+static GArray *
+build_id_table (GArray     *records,
+                GByteArray *pool)
+{
+  g_autoptr (GArray) slots = NULL;
+  guint n_slots            = 16;
+
+  /* keep the load factor at or below one half */
+  while (n_slots < records->len * 2)
+    n_slots *= 2;
+
+  slots = g_array_sized_new (FALSE, TRUE, sizeof (guint32), n_slots);
+  g_array_set_size (slots, n_slots);
+
+  for (guint i = 0; i < records->len; i++)
+    {
+      const char *id   = NULL;
+      guint32     slot = 0;
+
+      id = pool_peek (pool, g_array_index (records, SearchIndexRecord, i).id);
+      if (id == NULL)
+        continue;
+
+      slot = search_index_id_hash (id) & (n_slots - 1);
+      while (g_array_index (slots, guint32, slot) != 0)
+        slot = (slot + 1) & (n_slots - 1);
+
+      g_array_index (slots, guint32, slot) = GUINT32_TO_LE (i + 1);
+    }
+
+  return g_steal_pointer (&slots);
+}
+
+static gint
+cmp_uint32 (gconstpointer a,
+            gconstpointer b)
+{
+  guint32 ua = *(const guint32 *) a;
+  guint32 ub = *(const guint32 *) b;
+
+  return (ua > ub) - (ua < ub);
+}
+
+static void
+pad_to_alignment (GByteArray *buffer)
+{
+  guint old_len = 0;
+  guint new_len = 0;
+
+  old_len = buffer->len;
+  new_len = (old_len + SEARCH_INDEX_ALIGNMENT - 1) & ~(SEARCH_INDEX_ALIGNMENT - 1);
+  if (new_len == old_len)
+    return;
+
+  g_byte_array_set_size (buffer, new_len);
+  memset (buffer->data + old_len, 0, new_len - old_len);
+}
+
+static GByteArray *
+assemble_index (guint32        n_entries,
+                const Section *sections,
+                guint          n_sections)
+{
+  g_autoptr (GByteArray) buffer = NULL;
+  SearchIndexHeader   header    = { 0 };
+  SearchIndexSection *table     = NULL;
+
+  buffer = g_byte_array_new ();
+
+  memcpy (header.magic, SEARCH_INDEX_MAGIC, 4);
+  header.version    = GUINT32_TO_LE (SEARCH_INDEX_VERSION_2);
+  header.n_entries  = GUINT32_TO_LE (n_entries);
+  header.n_sections = GUINT32_TO_LE (n_sections);
+  g_byte_array_append (buffer, (const guint8 *) &header, sizeof (header));
+
+  /* the table is filled in as the payloads get placed */
+  g_byte_array_set_size (buffer, sizeof (header) + n_sections * sizeof (SearchIndexSection));
+  memset (buffer->data + sizeof (header), 0, n_sections * sizeof (SearchIndexSection));
+
+  for (guint i = 0; i < n_sections; i++)
+    {
+      guint offset = 0;
+
+      pad_to_alignment (buffer);
+      offset = buffer->len;
+      if (sections[i].size > 0)
+        g_byte_array_append (buffer, sections[i].data, sections[i].size);
+
+      table = (SearchIndexSection *) (buffer->data + sizeof (header));
+
+      table[i].kind   = GUINT32_TO_LE (sections[i].kind);
+      table[i].offset = GUINT32_TO_LE (offset);
+      table[i].size   = GUINT32_TO_LE (sections[i].size);
+    }
 
-  return TRUE;
+  return g_steal_pointer (&buffer);
 }
 
 static gboolean
@@ -24,24 +24,8 @@
 
 G_BEGIN_DECLS
 
-/*
- * HEADER:
- * char[4] "BZSI"
- * uint32  version
- * uint32  entry count
- *
- * CONTENT:
- * id
- * title
- * developer
- * description (cut off)
- * search_tokens
- * icon_path
- *
- * with strings as uint32 length + uint8[] bytes
- *
- */
-
+/* Writes the catalog in the mappable layout described in
+ * search-index-format.h */
 gboolean
 bz_write_search_index (GListModel *groups,
                        const char *out_path,
@@ -22,253 +22,1085 @@
 
 #include "search-index.h"
 
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
-#define INDEX_MAGIC "BZSI"
+#define V1_FIELDS_PER_ENTRY 6
 
-static int    read_u32 (FILE *f, unsigned int *out);
-static char  *read_field (FILE *f);
-static void   free_entries (SearchIndexEntry *entries, unsigned int count);
-static double score_field (const char *term, const char *field, double weight);
-static double score_entry (const SearchIndexEntry *e, const char *const *terms, int n_terms);
-static int    cmp_matches (const void *a, const void *b);
+/* how many entries get scored between looks at the clock */
+#define SCAN_CLOCK_INTERVAL 256
+
+typedef struct
+{
+  const uint32_t *items;
+  uint32_t        count;
+} PostingList;
+
+/* Precedes a v2 image exported to a memfd, identifying the file on disk it
+ * was loaded from */
+#define STASH_MAGIC "BZSS"
+
+typedef struct
+{
+  char     magic[4];
+  uint32_t reserved;
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t size;
+  int64_t  mtime_sec;
+  int64_t  mtime_nsec;
+  uint64_t image_size;
+} StashHeader;
+
+static int         write_all (int fd, const void *buf, size_t size);
+static int         read_all (int fd, void *buf, size_t size);
+static int         load_v1 (SearchIndex *idx, int fd, size_t size);
+static int         load_v2 (SearchIndex *idx, int fd, size_t size);
+static int         parse_v2 (SearchIndex *idx, const void *image, size_t size);
+static int         same_source (const StashHeader *stash, const struct stat *st);
+static const char *pool_string (const SearchIndex *idx, uint32_t offset);
+static int         match_id (const SearchIndex *idx, unsigned int index, const char *id);
+static long        collect_candidates (const SearchIndex *idx, const char *const *terms, int n_terms, unsigned int **out);
+static int         find_trigram (const SearchIndex *idx, uint32_t key, PostingList *out);
+static size_t      intersect_postings (unsigned int *candidates, size_t n_candidates, const PostingList *list);
+static int         cmp_posting_lists (const void *a, const void *b);
+static char      **fold_terms (const SearchIndex *idx, const char *const *terms, int n_terms);
+static size_t      fold_into (const SearchIndex *idx, const char *term, char *out);
+static size_t      decode_utf8 (const char *str, uint32_t *out);
+static int         find_fold (const SearchIndex *idx, uint32_t codepoint, const char **out);
+static void        free_terms (char **terms, int n_terms);
+static void        get_searchable (const SearchIndex *idx, unsigned int index, SearchIndexEntry *out);
+static double      score_field (const char *term, const char *field, double weight, int folded);
+static double      score_entry (const SearchIndexEntry *e, const char *const *terms, int n_terms, int folded);
+static void        add_hit (SearchIndexHits *hits, unsigned int index);
+static void        heap_sift_up (SearchIndexMatch *heap, size_t pos);
+static void        heap_sift_down (SearchIndexMatch *heap, size_t n, size_t pos);
+static uint64_t    monotonic_usec (void);
+static int         cmp_matches (const void *a, const void *b);
 
 SearchIndex *
 search_index_open (const char *path)
 {
-  FILE             *f        = NULL;
-  char              magic[4] = { 0 };
-  unsigned int      version  = 0;
-  unsigned int      count    = 0;
-  SearchIndexEntry *entries  = NULL;
-  SearchIndex      *idx      = NULL;
-  struct stat       st       = { 0 };
-  unsigned int      i        = 0;
-
-  f = fopen (path, "rb");
-  if (f == NULL)
+  int               fd     = -1;
+  struct stat       st     = { 0 };
+  SearchIndexHeader header = { 0 };
+  SearchIndex      *idx    = NULL;
+  int               r      = -1;
+
+  fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
     return NULL;
 
-  if (fread (magic, 1, 4, f) != 4 || memcmp (magic, INDEX_MAGIC, 4) != 0)
+  if (fstat (fd, &st) != 0 ||
+      (size_t) st.st_size < 12 ||
+      pread (fd, &header, 12, 0) != 12 ||
+      memcmp (header.magic, SEARCH_INDEX_MAGIC, 4) != 0)
     {
-      fclose (f);
+      close (fd);
       return NULL;
     }
 
-  if (read_u32 (f, &version) < 0 || read_u32 (f, &count) < 0)
+  idx = calloc (1, sizeof (SearchIndex));
+  if (idx == NULL)
     {
-      fclose (f);
+      close (fd);
       return NULL;
     }
+  idx->ref_count = 1;
 
-  entries = calloc (count, sizeof (SearchIndexEntry));
-  if (entries == NULL)
+  switch (le32toh (header.version))
     {
-      fclose (f);
-      return NULL;
+    case SEARCH_INDEX_VERSION_1:
+      r = load_v1 (idx, fd, (size_t) st.st_size);
+      break;
+    case SEARCH_INDEX_VERSION_2:
+      r = load_v2 (idx, fd, (size_t) st.st_size);
+      break;
+    default:
+      r = -1;
+      break;
     }
 
-  for (i = 0; i < count; i++)
+  close (fd);
+
+  if (r < 0)
     {
-      entries[i].id            = read_field (f);
-      entries[i].title         = read_field (f);
-      entries[i].developer     = read_field (f);
-      entries[i].description   = read_field (f);
-      entries[i].search_tokens = read_field (f);
-      entries[i].icon_path     = read_field (f);
+      search_index_unref (idx);
+      return NULL;
+    }
 
-      if (entries[i].id == NULL || entries[i].title == NULL)
-        {
-          free_entries (entries, count);
-          fclose (f);
-          return NULL;
-        }
+  idx->path   = strdup (path);
+  idx->source = st;
+
+  return idx;
+}
+
+int
+search_index_export (const SearchIndex *idx)
+{
+  int         fd    = -1;
+  StashHeader stash = { 0 };
+
+  if (idx == NULL || idx->image == NULL)
+    return -1;
+
+  fd = memfd_create ("bazaar-search-index", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0)
+    return -1;
+
+  memcpy (stash.magic, STASH_MAGIC, 4);
+  stash.dev        = (uint64_t) idx->source.st_dev;
+  stash.ino        = (uint64_t) idx->source.st_ino;
+  stash.size       = (uint64_t) idx->source.st_size;
+  stash.mtime_sec  = (int64_t) idx->source.st_mtim.tv_sec;
+  stash.mtime_nsec = (int64_t) idx->source.st_mtim.tv_nsec;
+  stash.image_size = (uint64_t) idx->image_size;
+
+  if (write_all (fd, &stash, sizeof (stash)) < 0 ||
+      write_all (fd, idx->image, idx->image_size) < 0 ||
+      fcntl (fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0)
+    {
+      close (fd);
+      return -1;
     }
 
-  fclose (f);
+  return fd;
+}
+
+SearchIndex *
+search_index_adopt (int         fd,
+                    const char *path)
+{
+  struct stat        fd_st = { 0 };
+  struct stat        st    = { 0 };
+  const StashHeader *stash = NULL;
+  SearchIndex       *idx   = NULL;
+
+  if (fstat (fd, &fd_st) != 0 ||
+      (size_t) fd_st.st_size < sizeof (StashHeader) ||
+      stat (path, &st) != 0)
+    return NULL;
 
   idx = calloc (1, sizeof (SearchIndex));
   if (idx == NULL)
+    return NULL;
+  idx->ref_count = 1;
+
+  idx->data = mmap (NULL, (size_t) fd_st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (idx->data == MAP_FAILED)
     {
-      free_entries (entries, count);
+      free (idx);
+      return NULL;
+    }
+  idx->size   = (size_t) fd_st.st_size;
+  idx->mapped = 1;
+
+  stash = idx->data;
+  if (memcmp (stash->magic, STASH_MAGIC, 4) != 0 ||
+      stash->image_size > idx->size - sizeof (StashHeader) ||
+      !same_source (stash, &st) ||
+      parse_v2 (idx, stash + 1, (size_t) stash->image_size) < 0)
+    {
+      search_index_unref (idx);
       return NULL;
     }
 
-  idx->path    = strdup (path);
-  idx->entries = entries;
-  idx->count   = count;
+  idx->path   = strdup (path);
+  idx->source = st;
 
-  if (stat (path, &st) == 0)
-    idx->mtime = st.st_mtime;
+  return idx;
+}
+
+SearchIndex *
+search_index_ref (SearchIndex *idx)
+{
+  if (idx != NULL)
+    idx->ref_count++;
 
   return idx;
 }
 
 void
-search_index_close (SearchIndex *idx)
+search_index_unref (SearchIndex *idx)
 {
-  if (idx == NULL)
+  if (idx == NULL || --idx->ref_count > 0)
     return;
 
-  free_entries (idx->entries, idx->count);
+  if (idx->mapped)
+    munmap (idx->data, idx->size);
+  else
+    free (idx->data);
+
   free (idx->path);
   free (idx);
 }
 
-int
-search_index_reload_if_stale (SearchIndex **idx_ptr)
+void
+search_index_get_entry (const SearchIndex *idx,
+                        unsigned int       index,
+                        SearchIndexEntry  *out)
 {
-  struct stat  st    = { 0 };
-  SearchIndex *idx   = NULL;
-  SearchIndex *fresh = NULL;
+  const SearchIndexRecord *record = NULL;
 
-  idx = *idx_ptr;
+  record = &idx->records[index];
 
-  if (idx == NULL)
-    return 0;
+  out->id            = pool_string (idx, record->id);
+  out->title         = pool_string (idx, record->title);
+  out->developer     = pool_string (idx, record->developer);
+  out->description   = pool_string (idx, record->description);
+  out->search_tokens = pool_string (idx, record->search_tokens);
+  out->icon_path     = pool_string (idx, record->icon_path);
+}
 
-  if (stat (idx->path, &st) != 0)
-    return 0;
+size_t
+search_index_query (SearchIndex           *idx,
+                    const char *const     *terms,
+                    int                    n_terms,
+                    const SearchIndexHits *within,
+                    uint64_t               max_scan_usec,
+                    SearchIndexMatch      *out,
+                    size_t                 max_results,
+                    SearchIndexHits       *hits_out)
+{
+  size_t              n_matches    = 0;
+  char              **folded_terms = NULL;
+  const char *const  *match_terms  = terms;
+  unsigned int       *candidates   = NULL;
+  const unsigned int *scan         = NULL;
+  long                n_candidates = 0;
+  size_t              n_scan       = 0;
+  size_t              i            = 0;
+  unsigned int        entry_idx    = 0;
+  double              score        = 0.0;
+  uint64_t            deadline     = 0;
+  SearchIndexEntry    e            = { 0 };
+
+  if (hits_out != NULL)
+    {
+      hits_out->count    = 0;
+      hits_out->complete = 0;
+    }
 
-  if (st.st_mtime == idx->mtime)
+  if (idx == NULL || n_terms <= 0 || max_results == 0)
     return 0;
 
-  fresh = search_index_open (idx->path);
-  if (fresh == NULL)
-    return 0;
+  /* folded fields are matched byte for byte against folded terms */
+  if (idx->folded != NULL)
+    {
+      folded_terms = fold_terms (idx, terms, n_terms);
+      if (folded_terms == NULL)
+        return 0;
+      match_terms = (const char *const *) folded_terms;
+    }
 
-  search_index_close (idx);
-  *idx_ptr = fresh;
-  return 1;
-}
+  if (hits_out != NULL)
+    hits_out->complete = 1;
 
-size_t
-search_index_query (SearchIndex       *idx,
-                    const char *const *terms,
-                    int                n_terms,
-                    SearchIndexMatch  *out,
-                    size_t             max_results)
-{
-  size_t       n_matches = 0;
-  unsigned int i         = 0;
-  double       score     = 0.0;
+  if (max_scan_usec > 0)
+    deadline = monotonic_usec () + max_scan_usec;
 
-  if (idx == NULL || n_terms <= 0)
-    return 0;
+  if (within != NULL)
+    {
+      scan   = within->indices;
+      n_scan = within->count;
+    }
+  else
+    {
+      /* without usable postings every entry is a candidate */
+      n_candidates = collect_candidates (idx, match_terms, n_terms, &candidates);
+      scan         = candidates;
+      n_scan       = n_candidates < 0 ? idx->count : (size_t) n_candidates;
+    }
 
-  for (i = 0; i < idx->count && n_matches < max_results * 8; i++)
+  /* `out` is kept as a min-heap on score until the scan is over, so the
+   * weakest of the current top `max_results` is always at the root */
+  for (i = 0; i < n_scan; i++)
     {
-      score = score_entry (&idx->entries[i], terms, n_terms);
+      if (deadline > 0 &&
+          i % SCAN_CLOCK_INTERVAL == SCAN_CLOCK_INTERVAL - 1 &&
+          monotonic_usec () > deadline)
+        {
+          if (hits_out != NULL)
+            hits_out->complete = 0;
+          break;
+        }
+
+      entry_idx = scan != NULL ? scan[i] : (unsigned int) i;
+      if (entry_idx >= idx->count)
+        continue;
+
+      get_searchable (idx, entry_idx, &e);
+      score = score_entry (&e, match_terms, n_terms, idx->folded != NULL);
+      if (score <= 0.0)
+        continue;
 
-      if (score > 0.0 && n_matches < max_results * 8)
+      if (hits_out != NULL && hits_out->complete)
+        add_hit (hits_out, entry_idx);
+
+      if (n_matches < max_results)
         {
-          if (n_matches < max_results)
-            {
-              out[n_matches].entry = &idx->entries[i];
-              out[n_matches].score = score;
-            }
+          out[n_matches].index = entry_idx;
+          out[n_matches].score = score;
           n_matches++;
+          heap_sift_up (out, n_matches - 1);
+        }
+      else if (score > out[0].score)
+        {
+          out[0].index = entry_idx;
+          out[0].score = score;
+          heap_sift_down (out, n_matches, 0);
         }
     }
 
-  if (n_matches > max_results)
-    n_matches = max_results;
+  free (candidates);
+  free_terms (folded_terms, n_terms);
 
   qsort (out, n_matches, sizeof (SearchIndexMatch), cmp_matches);
 
   return n_matches;
 }
 
-const SearchIndexEntry *
-search_index_find (SearchIndex *idx,
-                   const char  *id)
+void
+search_index_hits_clear (SearchIndexHits *hits)
+{
+  if (hits == NULL)
+    return;
+
+  free (hits->indices);
+  hits->indices  = NULL;
+  hits->count    = 0;
+  hits->capacity = 0;
+  hits->complete = 0;
+}
+
+int
+search_index_find (SearchIndex      *idx,
+                   const char       *id,
+                   SearchIndexEntry *out)
 {
   unsigned int i = 0;
 
   if (idx == NULL || id == NULL)
-    return NULL;
+    return 0;
+
+  if (idx->id_slots != NULL)
+    {
+      uint32_t mask  = 0;
+      uint32_t slot  = 0;
+      uint32_t value = 0;
+
+      mask = idx->n_id_slots - 1;
+      slot = search_index_id_hash (id) & mask;
+
+      for (i = 0; i < idx->n_id_slots; i++)
+        {
+          value = le32toh (idx->id_slots[slot]);
+          if (value == 0)
+            return 0;
+
+          if (value - 1 < idx->count &&
+              match_id (idx, value - 1, id))
+            {
+              search_index_get_entry (idx, value - 1, out);
+              return 1;
+            }
+
+          slot = (slot + 1) & mask;
+        }
+
+      return 0;
+    }
 
   for (i = 0; i < idx->count; i++)
     {
-      if (strcmp (idx->entries[i].id, id) == 0)
-        return &idx->entries[i];
+      if (match_id (idx, i, id))
+        {
+          search_index_get_entry (idx, i, out);
+          return 1;
+        }
+    }
+
+  return 0;
+}
+
+static int
+write_all (int         fd,
+           const void *buf,
+           size_t      size)
+{
+  size_t  done = 0;
+  ssize_t n    = 0;
+
+  while (done < size)
+    {
+      n = write (fd, (const char *) buf + done, size - done);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return -1;
+      done += (size_t) n;
     }
 
-  return NULL;
+  return 0;
 }
 
 static int
-read_u32 (FILE         *f,
-          unsigned int *out)
+read_all (int    fd,
+          void  *buf,
+          size_t size)
 {
-  unsigned char b[4] = { 0 };
+  size_t  done = 0;
+  ssize_t n    = 0;
+
+  while (done < size)
+    {
+      n = pread (fd, (char *) buf + done, size - done, (off_t) done);
+      if (n <= 0)
+        return -1;
+      done += (size_t) n;
+    }
 
-  if (fread (b, 1, 4, f) != 4)
+  return 0;
+}
+
+/* Converts the streamed v1 layout into the in-memory shape of v2, so the
+ * rest of this file only ever deals with records and a string pool */
+static int
+load_v1 (SearchIndex *idx,
+         int          fd,
+         size_t       size)
+{
+  unsigned char     *file    = NULL;
+  size_t             pos     = 12;
+  uint32_t           count   = 0;
+  SearchIndexRecord *records = NULL;
+  char              *pool    = NULL;
+  size_t             pool_at = 1;
+  unsigned int       i       = 0;
+  int                j       = 0;
+
+  file = malloc (size);
+  if (file == NULL)
     return -1;
 
-  *out = (unsigned int) b[0] |
-         ((unsigned int) b[1] << 8) |
-         ((unsigned int) b[2] << 16) |
-         ((unsigned int) b[3] << 24);
+  if (read_all (fd, file, size) < 0)
+    {
+      free (file);
+      return -1;
+    }
+
+  memcpy (&count, file + 8, 4);
+  count = le32toh (count);
+
+  /* every entry needs at least six length prefixes */
+  if ((size - pos) / (4 * V1_FIELDS_PER_ENTRY) < count)
+    {
+      free (file);
+      return -1;
+    }
+
+  /* a length prefix is always at least as long as the NUL that replaces
+   * it, so the pool can never outgrow the file */
+  idx->data = malloc (sizeof (SearchIndexRecord) * count + size + 1);
+  if (idx->data == NULL)
+    {
+      free (file);
+      return -1;
+    }
+
+  records = idx->data;
+  pool    = (char *) (records + count);
+  pool[0] = '\0';
+
+  for (i = 0; i < count; i++)
+    {
+      uint32_t *fields = (uint32_t *) &records[i];
+
+      for (j = 0; j < V1_FIELDS_PER_ENTRY; j++)
+        {
+          uint32_t len = 0;
+
+          if (size - pos < 4)
+            {
+              free (file);
+              return -1;
+            }
+          memcpy (&len, file + pos, 4);
+          len = le32toh (len);
+          pos += 4;
+
+          if (size - pos < len)
+            {
+              free (file);
+              return -1;
+            }
+
+          if (len == 0)
+            {
+              fields[j] = 0;
+              continue;
+            }
+
+          memcpy (pool + pool_at, file + pos, len);
+          pool[pool_at + len] = '\0';
+          fields[j]           = htole32 ((uint32_t) pool_at);
+
+          pool_at += len + 1;
+          pos += len;
+        }
+
+      if (records[i].id == 0 || records[i].title == 0)
+        {
+          free (file);
+          return -1;
+        }
+    }
+
+  free (file);
+
+  idx->size         = sizeof (SearchIndexRecord) * count + size + 1;
+  idx->mapped       = 0;
+  idx->count        = count;
+  idx->records      = records;
+  idx->strings      = pool;
+  idx->strings_size = pool_at;
+
   return 0;
 }
 
-static char *
-read_field (FILE *f)
+static int
+load_v2 (SearchIndex *idx,
+         int          fd,
+         size_t       size)
+{
+  if (size < sizeof (SearchIndexHeader))
+    return -1;
+
+  idx->data = mmap (NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (idx->data == MAP_FAILED)
+    {
+      idx->data = NULL;
+      return -1;
+    }
+  idx->size   = size;
+  idx->mapped = 1;
+
+  return parse_v2 (idx, idx->data, size);
+}
+
+static int
+parse_v2 (SearchIndex *idx,
+          const void  *image,
+          size_t       size)
 {
-  unsigned int len = 0;
-  char        *str = NULL;
+  const SearchIndexHeader  *header     = NULL;
+  const SearchIndexSection *sections   = NULL;
+  uint32_t                  count      = 0;
+  uint32_t                  n_sections = 0;
+  uint32_t                  i          = 0;
 
-  if (read_u32 (f, &len) < 0)
-    return NULL;
+  if (size < sizeof (SearchIndexHeader))
+    return -1;
 
-  if (len == 0)
+  header     = image;
+  count      = le32toh (header->n_entries);
+  n_sections = le32toh (header->n_sections);
+
+  if ((size - sizeof (SearchIndexHeader)) / sizeof (SearchIndexSection) < n_sections)
+    return -1;
+
+  sections = (const SearchIndexSection *) (header + 1);
+  for (i = 0; i < n_sections; i++)
+    {
+      uint32_t    kind    = 0;
+      uint32_t    offset  = 0;
+      uint32_t    len     = 0;
+      const void *payload = NULL;
+
+      kind   = le32toh (sections[i].kind);
+      offset = le32toh (sections[i].offset);
+      len    = le32toh (sections[i].size);
+
+      if (offset % SEARCH_INDEX_ALIGNMENT != 0 ||
+          offset > size ||
+          len > size - offset)
+        return -1;
+
+      payload = (const char *) image + offset;
+
+      switch (kind)
+        {
+        case SEARCH_INDEX_SECTION_RECORDS:
+          if ((uint64_t) count * sizeof (SearchIndexRecord) != len)
+            return -1;
+          idx->records = payload;
+          break;
+        case SEARCH_INDEX_SECTION_TRIGRAMS:
+          idx->trigrams   = payload;
+          idx->n_trigrams = len / sizeof (SearchIndexTrigram);
+          break;
+        case SEARCH_INDEX_SECTION_POSTINGS:
+          idx->postings   = payload;
+          idx->n_postings = len / sizeof (uint32_t);
+          break;
+        case SEARCH_INDEX_SECTION_IDS:
+          idx->id_slots   = payload;
+          idx->n_id_slots = len / sizeof (uint32_t);
+          break;
+        case SEARCH_INDEX_SECTION_FOLDED:
+          /* an index without folded fields is still searchable */
+          if ((uint64_t) count * sizeof (SearchIndexFoldedRecord) == len)
+            idx->folded = payload;
+          break;
+        case SEARCH_INDEX_SECTION_FOLDS:
+          idx->folds   = payload;
+          idx->n_folds = len / sizeof (SearchIndexFold);
+          break;
+        case SEARCH_INDEX_SECTION_STRINGS:
+          /* a terminated pool means no offset can read past the end */
+          if (len == 0 || ((const char *) payload)[len - 1] != '\0')
+            return -1;
+          idx->strings      = payload;
+          idx->strings_size = len;
+          break;
+        default:
+          break;
+        }
+    }
+
+  if (idx->strings == NULL || (count > 0 && idx->records == NULL))
+    return -1;
+
+  if (idx->trigrams == NULL || idx->postings == NULL)
+    {
+      idx->trigrams   = NULL;
+      idx->n_trigrams = 0;
+    }
+
+  /* probing relies on masking with a power of two */
+  if (idx->n_id_slots == 0 || (idx->n_id_slots & (idx->n_id_slots - 1)) != 0)
+    {
+      idx->id_slots   = NULL;
+      idx->n_id_slots = 0;
+    }
+
+  idx->count      = count;
+  idx->image      = image;
+  idx->image_size = size;
+
+  return 0;
+}
+
+static int
+same_source (const StashHeader *stash,
+             const struct stat *st)
+{
+  return stash->dev == (uint64_t) st->st_dev &&
+         stash->ino == (uint64_t) st->st_ino &&
+         stash->size == (uint64_t) st->st_size &&
+         stash->mtime_sec == (int64_t) st->st_mtim.tv_sec &&
+         stash->mtime_nsec == (int64_t) st->st_mtim.tv_nsec;
+}
+
+static const char *
+pool_string (const SearchIndex *idx,
+             uint32_t           offset)
+{
+  offset = le32toh (offset);
+
+  if (offset == 0 || offset >= idx->strings_size)
     return NULL;
 
-  str = malloc (len + 1);
-  if (str == NULL)
+  return idx->strings + offset;
+}
+
+static int
+match_id (const SearchIndex *idx,
+          unsigned int       index,
+          const char        *id)
+{
+  const char *entry_id = NULL;
+
+  entry_id = pool_string (idx, idx->records[index].id);
+  return entry_id != NULL && strcmp (entry_id, id) == 0;
+}
+
+/* Returns -1 if the postings can't narrow the search down, otherwise the
+ * number of entries which contain every trigram of every term */
+static long
+collect_candidates (const SearchIndex *idx,
+                    const char *const *terms,
+                    int                n_terms,
+                    unsigned int     **out)
+{
+  PostingList  *lists        = NULL;
+  size_t        n_lists      = 0;
+  size_t        max_lists    = 0;
+  unsigned int *candidates   = NULL;
+  size_t        n_candidates = 0;
+  size_t        len          = 0;
+  size_t        i            = 0;
+  size_t        j            = 0;
+  int           t            = 0;
+
+  *out = NULL;
+
+  if (idx->trigrams == NULL)
+    return -1;
+
+  for (t = 0; t < n_terms; t++)
+    {
+      len = terms[t] != NULL ? strlen (terms[t]) : 0;
+      if (len >= 3)
+        max_lists += len - 2;
+    }
+  if (max_lists == 0)
+    return -1;
+
+  lists = malloc (sizeof (PostingList) * max_lists);
+  if (lists == NULL)
+    return -1;
+
+  for (t = 0; t < n_terms; t++)
+    {
+      len = terms[t] != NULL ? strlen (terms[t]) : 0;
+
+      for (j = 0; j + 2 < len; j++)
+        {
+          if (!find_trigram (idx, search_index_trigram_key (terms[t] + j), &lists[n_lists]))
+            {
+              free (lists);
+              return 0;
+            }
+          n_lists++;
+        }
+    }
+
+  /* start from the rarest trigram so the working set only shrinks */
+  qsort (lists, n_lists, sizeof (PostingList), cmp_posting_lists);
+
+  candidates = malloc (sizeof (unsigned int) * (lists[0].count > 0 ? lists[0].count : 1));
+  if (candidates == NULL)
+    {
+      free (lists);
+      return -1;
+    }
+
+  for (i = 0; i < lists[0].count; i++)
+    {
+      if (le32toh (lists[0].items[i]) < idx->count)
+        candidates[n_candidates++] = le32toh (lists[0].items[i]);
+    }
+
+  for (i = 1; i < n_lists && n_candidates > 0; i++)
+    n_candidates = intersect_postings (candidates, n_candidates, &lists[i]);
+
+  free (lists);
+
+  *out = candidates;
+  return (long) n_candidates;
+}
+
+static int
+find_trigram (const SearchIndex *idx,
+              uint32_t           key,
+              PostingList       *out)
+{
+  uint32_t lo    = 0;
+  uint32_t hi    = 0;
+  uint32_t mid   = 0;
+  uint32_t found = 0;
+  uint32_t first = 0;
+  uint32_t count = 0;
+
+  hi = idx->n_trigrams;
+  while (lo < hi)
+    {
+      mid   = lo + (hi - lo) / 2;
+      found = le32toh (idx->trigrams[mid].key);
+
+      if (found == key)
+        {
+          first = le32toh (idx->trigrams[mid].first);
+          count = le32toh (idx->trigrams[mid].count);
+          if (first > idx->n_postings || count > idx->n_postings - first)
+            return 0;
+
+          out->items = idx->postings + first;
+          out->count = count;
+          return 1;
+        }
+      else if (found < key)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  return 0;
+}
+
+static size_t
+intersect_postings (unsigned int      *candidates,
+                    size_t             n_candidates,
+                    const PostingList *list)
+{
+  size_t   kept = 0;
+  uint32_t pos  = 0;
+  uint32_t lo   = 0;
+  uint32_t hi   = 0;
+  uint32_t mid  = 0;
+  size_t   i    = 0;
+
+  /* both sides are sorted, so each lookup resumes where the last ended */
+  for (i = 0; i < n_candidates && pos < list->count; i++)
+    {
+      lo = pos;
+      hi = list->count;
+      while (lo < hi)
+        {
+          mid = lo + (hi - lo) / 2;
+          if (le32toh (list->items[mid]) < candidates[i])
+            lo = mid + 1;
+          else
+            hi = mid;
+        }
+
+      pos = lo;
+      if (pos < list->count && le32toh (list->items[pos]) == candidates[i])
+        candidates[kept++] = candidates[i];
+    }
+
+  return kept;
+}
+
+static int
+cmp_posting_lists (const void *a,
+                   const void *b)
+{
+  const PostingList *la = a;
+  const PostingList *lb = b;
+
+  return (la->count > lb->count) - (la->count < lb->count);
+}
+
+/* Folds every term the way the writer folded the fields, or returns NULL
+ * if memory runs out */
+static char **
+fold_terms (const SearchIndex *idx,
+            const char *const *terms,
+            int                n_terms)
+{
+  char **folded = NULL;
+  size_t len    = 0;
+  int    i      = 0;
+
+  folded = calloc ((size_t) n_terms, sizeof (char *));
+  if (folded == NULL)
     return NULL;
 
-  if (fread (str, 1, len, f) != len)
+  for (i = 0; i < n_terms; i++)
     {
-      free (str);
-      return NULL;
+      if (terms[i] == NULL)
+        continue;
+
+      /* measure first, then fill */
+      len       = fold_into (idx, terms[i], NULL);
+      folded[i] = malloc (len + 1);
+      if (folded[i] == NULL)
+        {
+          free_terms (folded, n_terms);
+          return NULL;
+        }
+
+      fold_into (idx, terms[i], folded[i]);
+      folded[i][len] = '\0';
+    }
+
+  return folded;
+}
+
+/* Writes the folded form of `term` to `out` if it is set, and returns its
+ * length either way */
+static size_t
+fold_into (const SearchIndex *idx,
+           const char        *term,
+           char              *out)
+{
+  size_t      len        = 0;
+  size_t      step       = 0;
+  uint32_t    codepoint  = 0;
+  const char *folded     = NULL;
+  size_t      folded_len = 0;
+
+  while (*term != '\0')
+    {
+      step = decode_utf8 (term, &codepoint);
+
+      if (codepoint < 0x80)
+        {
+          if (out != NULL)
+            out[len] = (char) (codepoint >= 'A' && codepoint <= 'Z'
+                                   ? codepoint + ('a' - 'A')
+                                   : codepoint);
+          len++;
+        }
+      else if (find_fold (idx, codepoint, &folded))
+        {
+          folded_len = folded != NULL ? strlen (folded) : 0;
+          if (out != NULL && folded_len > 0)
+            memcpy (out + len, folded, folded_len);
+          len += folded_len;
+        }
+      else
+        {
+          /* anything the table doesn't know folds to itself */
+          if (out != NULL)
+            memcpy (out + len, term, step);
+          len += step;
+        }
+
+      term += step;
+    }
+
+  return len;
+}
+
+/* Decodes one UTF-8 sequence, yielding UINT32_MAX for a malformed one so
+ * that its first byte is passed through untouched */
+static size_t
+decode_utf8 (const char *str,
+             uint32_t   *out)
+{
+  const unsigned char *s         = (const unsigned char *) str;
+  size_t               len       = 0;
+  uint32_t             codepoint = 0;
+  size_t               i         = 0;
+
+  if (s[0] < 0x80)
+    {
+      *out = s[0];
+      return 1;
+    }
+  else if ((s[0] & 0xE0) == 0xC0)
+    {
+      len       = 2;
+      codepoint = s[0] & 0x1F;
+    }
+  else if ((s[0] & 0xF0) == 0xE0)
+    {
+      len       = 3;
+      codepoint = s[0] & 0x0F;
+    }
+  else if ((s[0] & 0xF8) == 0xF0)
+    {
+      len       = 4;
+      codepoint = s[0] & 0x07;
+    }
+  else
+    {
+      *out = UINT32_MAX;
+      return 1;
+    }
+
+  /* the terminating NUL is never a continuation byte */
+  for (i = 1; i < len; i++)
+    {
+      if ((s[i] & 0xC0) != 0x80)
+        {
+          *out = UINT32_MAX;
+          return 1;
+        }
+      codepoint = (codepoint << 6) | (s[i] & 0x3F);
+    }
+
+  *out = codepoint;
+  return len;
+}
+
+static int
+find_fold (const SearchIndex *idx,
+           uint32_t           codepoint,
+           const char       **out)
+{
+  uint32_t lo    = 0;
+  uint32_t hi    = 0;
+  uint32_t mid   = 0;
+  uint32_t found = 0;
+
+  hi = idx->n_folds;
+  while (lo < hi)
+    {
+      mid   = lo + (hi - lo) / 2;
+      found = le32toh (idx->folds[mid].codepoint);
+
+      if (found == codepoint)
+        {
+          *out = pool_string (idx, idx->folds[mid].folded);
+          return 1;
+        }
+      else if (found < codepoint)
+        lo = mid + 1;
+      else
+        hi = mid;
     }
 
-  str[len] = '\0';
-  return str;
+  return 0;
 }
 
 static void
-free_entries (SearchIndexEntry *entries,
-              unsigned int      count)
+free_terms (char **terms,
+            int    n_terms)
 {
-  unsigned int i = 0;
+  int i = 0;
 
-  if (entries == NULL)
+  if (terms == NULL)
     return;
 
-  for (i = 0; i < count; i++)
+  for (i = 0; i < n_terms; i++)
+    free (terms[i]);
+  free (terms);
+}
+
+/* Fills in the fields a query is matched against, which are the folded
+ * copies when the index has them */
+static void
+get_searchable (const SearchIndex *idx,
+                unsigned int       index,
+                SearchIndexEntry  *out)
+{
+  const SearchIndexFoldedRecord *folded = NULL;
+
+  if (idx->folded == NULL)
     {
-      free (entries[i].id);
-      free (entries[i].title);
-      free (entries[i].developer);
-      free (entries[i].description);
-      free (entries[i].search_tokens);
-      free (entries[i].icon_path);
+      search_index_get_entry (idx, index, out);
+      return;
     }
 
-  free (entries);
+  folded = &idx->folded[index];
+
+  out->id            = NULL;
+  out->title         = pool_string (idx, folded->title);
+  out->developer     = pool_string (idx, folded->developer);
+  out->description   = pool_string (idx, folded->description);
+  out->search_tokens = pool_string (idx, folded->search_tokens);
+  out->icon_path     = NULL;
 }
 
 static double
 score_field (const char *term,
              const char *field,
-             double      weight)
+             double      weight,
+             int         folded)
 {
   const char *hit       = NULL;
   size_t      term_len  = 0;
@@ -277,7 +1109,7 @@ score_field (const char *term,
   if (field == NULL || term == NULL || *term == '\0')
     return 0.0;
 
-  hit = strcasestr (field, term);
+  hit = folded ? strstr (field, term) : strcasestr (field, term);
   if (hit == NULL)
     return 0.0;
 
@@ -292,7 +1124,8 @@ score_field (const char *term,
 static double
 score_entry (const SearchIndexEntry *e,
              const char *const      *terms,
-             int                     n_terms)
+             int                     n_terms,
+             int                     folded)
 {
   double      total      = 0.0;
   int         i          = 0;
@@ -307,10 +1140,10 @@ score_entry (const SearchIndexEntry *e,
       if (term == NULL || *term == '\0')
         continue;
 
-      term_score += score_field (term, e->title, 2.0);
-      term_score += score_field (term, e->developer, 1.0);
-      term_score += score_field (term, e->description, 1.0);
-      term_score += score_field (term, e->search_tokens, 1.5);
+      term_score += score_field (term, e->title, 2.0, folded);
+      term_score += score_field (term, e->developer, 1.0, folded);
+      term_score += score_field (term, e->description, 1.0, folded);
+      term_score += score_field (term, e->search_tokens, 1.5, folded);
 
       if (term_score <= 0.0)
         return 0.0;
@@ -321,6 +1154,90 @@ score_entry (const SearchIndexEntry *e,
   return total;
 }
 
+static void
+add_hit (SearchIndexHits *hits,
+         unsigned int     index)
+{
+  unsigned int *grown    = NULL;
+  size_t        capacity = 0;
+
+  if (hits->count == hits->capacity)
+    {
+      capacity = hits->capacity > 0 ? hits->capacity * 2 : 256;
+      grown    = realloc (hits->indices, sizeof (unsigned int) * capacity);
+      if (grown == NULL)
+        {
+          /* a partial set must never be used to narrow a later query */
+          hits->complete = 0;
+          return;
+        }
+
+      hits->indices  = grown;
+      hits->capacity = capacity;
+    }
+
+  hits->indices[hits->count++] = index;
+}
+
+static void
+heap_sift_up (SearchIndexMatch *heap,
+              size_t            pos)
+{
+  SearchIndexMatch tmp    = { 0 };
+  size_t           parent = 0;
+
+  while (pos > 0)
+    {
+      parent = (pos - 1) / 2;
+      if (heap[parent].score <= heap[pos].score)
+        break;
+
+      tmp          = heap[parent];
+      heap[parent] = heap[pos];
+      heap[pos]    = tmp;
+      pos          = parent;
+    }
+}
+
+static void
+heap_sift_down (SearchIndexMatch *heap,
+                size_t            n,
+                size_t            pos)
+{
+  SearchIndexMatch tmp      = { 0 };
+  size_t           child    = 0;
+  size_t           smallest = 0;
+
+  for (;;)
+    {
+      smallest = pos;
+
+      child = 2 * pos + 1;
+      if (child < n && heap[child].score < heap[smallest].score)
+        smallest = child;
+      child++;
+      if (child < n && heap[child].score < heap[smallest].score)
+        smallest = child;
+
+      if (smallest == pos)
+        break;
+
+      tmp            = heap[smallest];
+      heap[smallest] = heap[pos];
+      heap[pos]      = tmp;
+      pos            = smallest;
+    }
+}
+
+static uint64_t
+monotonic_usec (void)
+{
+  struct timespec ts = { 0 };
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000ULL + (uint64_t) ts.tv_nsec / 1000ULL;
+}
+
 static int
 cmp_matches (const void *a,
              const void *b)
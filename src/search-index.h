@@ -21,47 +21,108 @@
 #pragma once
 
 #include <stddef.h>
-#include <time.h>
+#include <stdint.h>
+#include <sys/stat.h>
 
+#include "search-index-format.h"
+
+/* A view into the loaded index; the strings are owned by the index */
 typedef struct
 {
-  char *id;
-  char *title;
-  char *developer;
-  char *description;
-  char *search_tokens;
-  char *icon_path;
+  const char *id;
+  const char *title;
+  const char *developer;
+  const char *description;
+  const char *search_tokens;
+  const char *icon_path;
 } SearchIndexEntry;
 
 typedef struct
 {
-  char             *path;
-  time_t            mtime;
-  SearchIndexEntry *entries;
-  unsigned int      count;
+  int                            ref_count;
+  char                          *path;
+  struct stat                    source;
+  unsigned int                   count;
+  void                          *data;
+  size_t                         size;
+  int                            mapped;
+  const void                    *image;
+  size_t                         image_size;
+  const SearchIndexRecord       *records;
+  const char                    *strings;
+  size_t                         strings_size;
+  const SearchIndexTrigram      *trigrams;
+  uint32_t                       n_trigrams;
+  const uint32_t                *postings;
+  uint32_t                       n_postings;
+  const uint32_t                *id_slots;
+  uint32_t                       n_id_slots;
+  const SearchIndexFoldedRecord *folded;
+  const SearchIndexFold         *folds;
+  uint32_t                       n_folds;
 } SearchIndex;
 
 typedef struct
 {
-  const SearchIndexEntry *entry;
-  double                  score;
+  unsigned int index;
+  double       score;
 } SearchIndexMatch;
 
+/* Every entry a query matched, in index order. `complete` is unset if the
+ * scan was cut short, in which case the set can't stand in for the index */
+typedef struct
+{
+  unsigned int *indices;
+  size_t        count;
+  size_t        capacity;
+  int           complete;
+} SearchIndexHits;
+
 SearchIndex *
 search_index_open (const char *path);
 
+/* Copies a mapped index into a sealed memfd which search_index_adopt() can
+ * later map again, for as long as the file at `path` is left untouched.
+ * Returns -1 if the index isn't backed by a v2 image. */
+int
+search_index_export (const SearchIndex *idx);
+
+SearchIndex *
+search_index_adopt (int         fd,
+                    const char *path);
+
+/* References are not atomic, an index must only be shared within the
+ * thread that owns it */
+SearchIndex *
+search_index_ref (SearchIndex *idx);
+
 void
-search_index_close (SearchIndex *idx);
+search_index_unref (SearchIndex *idx);
 
-int
-search_index_reload_if_stale (SearchIndex **idx);
+void
+search_index_get_entry (const SearchIndex *idx,
+                        unsigned int       index,
+                        SearchIndexEntry  *out);
 
+/* Fills `out` with the best `max_results` matches, best first. A non-zero
+ * `max_scan_usec` stops the scan early once that much time has passed, in
+ * which case the result only ranks the entries seen so far. If `within` is
+ * set only those entries are considered, and if `hits_out` is set it
+ * receives every match. */
 size_t
-search_index_query (SearchIndex       *idx,
-                    const char *const *terms,
-                    int                n_terms,
-                    SearchIndexMatch  *out,
-                    size_t             max_results);
-
-const SearchIndexEntry *
-search_index_find (SearchIndex *idx, const char *id);
+search_index_query (SearchIndex           *idx,
+                    const char *const     *terms,
+                    int                    n_terms,
+                    const SearchIndexHits *within,
+                    uint64_t               max_scan_usec,
+                    SearchIndexMatch      *out,
+                    size_t                 max_results,
+                    SearchIndexHits       *hits_out);
+
+void
+search_index_hits_clear (SearchIndexHits *hits);
+
+int
+search_index_find (SearchIndex      *idx,
+                   const char       *id,
+                   SearchIndexEntry *out);